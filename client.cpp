@@ -1,7 +1,12 @@
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <cstdlib>
 #include <sstream>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <chrono>
 #include <winsock2.h>
 
 #pragma comment(lib, "ws2_32.lib")
@@ -9,6 +14,7 @@
 const int BUFFER_SIZE = 4096;
 const std::string SERVER_IP = "127.0.0.1";
 const int SERVER_PORT = 8888;
+const int HEARTBEAT_INTERVAL_SECONDS = 20; // Well inside the server's idle timeout
 
 void printMenu() {
     std::cout << "=== Chat Client ===" << std::endl;
@@ -26,43 +32,37 @@ void printMenu() {
     std::cout << "12. Update Profile" << std::endl;
     std::cout << "13. Send File" << std::endl;
     std::cout << "14. Get File" << std::endl;
-    std::cout << "15. Exit" << std::endl;
+    std::cout << "15. Set Presence" << std::endl;
+    std::cout << "16. Search Chat Room History" << std::endl;
+    std::cout << "17. Exit" << std::endl;
     std::cout << "==================" << std::endl;
     std::cout << "Select an option: ";
 }
 
-SOCKET connectToServer() {
-    // Initialize Winsock
-    WSADATA wsaData;
-    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-        std::cerr << "Failed to initialize Winsock." << std::endl;
-        return INVALID_SOCKET;
-    }
-
+// Connects only once the user has typed their credentials, because the server
+// closes a connection that does not log in within its handshake timeout.
+SOCKET connectToServer(int port) {
     // Create a socket
     SOCKET clientSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (clientSocket == INVALID_SOCKET) {
         std::cerr << "Failed to create socket." << std::endl;
-        WSACleanup();
         return INVALID_SOCKET;
     }
 
     // Connect to the server
     sockaddr_in serverAddress{};
     serverAddress.sin_family = AF_INET;
-    serverAddress.sin_port = htons(SERVER_PORT);
+    serverAddress.sin_port = htons(port);
     serverAddress.sin_addr.s_addr = inet_addr(SERVER_IP.c_str());
     if (serverAddress.sin_addr.s_addr == INADDR_NONE) {
         std::cerr << "Failed to parse server IP address." << std::endl;
         closesocket(clientSocket);
-        WSACleanup();
         return INVALID_SOCKET;
     }
 
     if (connect(clientSocket, reinterpret_cast<sockaddr*>(&serverAddress), sizeof(serverAddress)) == SOCKET_ERROR) {
         std::cerr << "Failed to connect to the server." << std::endl;
         closesocket(clientSocket);
-        WSACleanup();
         return INVALID_SOCKET;
     }
 
@@ -73,6 +73,40 @@ void sendRequest(SOCKET clientSocket, const std::string& request) {
     send(clientSocket, request.c_str(), static_cast<int>(request.length()), 0);
 }
 
+// Keeps the session alive while the user sits at the menu.
+void sendHeartbeats(SOCKET clientSocket) {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(HEARTBEAT_INTERVAL_SECONDS));
+        sendRequest(clientSocket, "HEARTBEAT\n");
+    }
+}
+
+// Acknowledges the newest "[room #sequence]" message seen in each room so the
+// server only replays what was missed when we reconnect.
+void acknowledgeMessages(SOCKET clientSocket, const std::string& response) {
+    std::map<std::string, unsigned long> latest;
+    std::istringstream lines(response);
+    std::string line;
+    while (std::getline(lines, line)) {
+        size_t prefixEnd = line.find("] ");
+        if (line.empty() || line[0] != '[' || prefixEnd == std::string::npos) {
+            continue;
+        }
+        size_t sequencePos = line.rfind(" #", prefixEnd);
+        if (sequencePos == std::string::npos || sequencePos == 0) {
+            continue;
+        }
+        unsigned long sequence = std::strtoul(line.substr(sequencePos + 2, prefixEnd - sequencePos - 2).c_str(), nullptr, 10);
+        unsigned long& newest = latest[line.substr(1, sequencePos - 1)];
+        newest = std::max(newest, sequence);
+    }
+    for (const auto& room : latest) {
+        if (room.second > 0) {
+            sendRequest(clientSocket, "ACK:" + room.first + ":" + std::to_string(room.second) + "\n");
+        }
+    }
+}
+
 std::string receiveResponse(SOCKET clientSocket) {
     char buffer[BUFFER_SIZE];
     memset(buffer, 0, BUFFER_SIZE);
@@ -81,35 +115,54 @@ std::string receiveResponse(SOCKET clientSocket) {
         std::cerr << "Error receiving response from the server." << std::endl;
         return "";
     }
-    return std::string(buffer);
+    std::string response(buffer);
+    acknowledgeMessages(clientSocket, response);
+    return response;
 }
 
-void registerUser(SOCKET clientSocket) {
+// Registers over a connection of its own, which is closed again so it cannot
+// time out while the user sits at the menu.
+void registerUser(int port) {
     std::string username, password;
     std::cout << "Enter username: ";
     std::getline(std::cin, username);
     std::cout << "Enter password: ";
     std::getline(std::cin, password);
 
+    SOCKET clientSocket = connectToServer(port);
+    if (clientSocket == INVALID_SOCKET) {
+        return;
+    }
     std::string request = "REGISTER:" + username + ":" + password + "\n";
     sendRequest(clientSocket, request);
 
     std::string response = receiveResponse(clientSocket);
     std::cout << response << std::endl;
+    closesocket(clientSocket);
 }
 
-void loginUser(SOCKET clientSocket) {
+// Returns the logged-in connection, or INVALID_SOCKET if the login failed.
+SOCKET loginUser(int port) {
     std::string username, password;
     std::cout << "Enter username: ";
     std::getline(std::cin, username);
     std::cout << "Enter password: ";
     std::getline(std::cin, password);
 
+    SOCKET clientSocket = connectToServer(port);
+    if (clientSocket == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
     std::string request = "AUTHENTICATE:" + username + ":" + password + "\n";
     sendRequest(clientSocket, request);
 
     std::string response = receiveResponse(clientSocket);
     std::cout << response << std::endl;
+    if (response.compare(0, 26, "Authentication successful!") != 0) {
+        closesocket(clientSocket);
+        return INVALID_SOCKET;
+    }
+    return clientSocket;
 }
 
 void joinChatRoom(SOCKET clientSocket) {
@@ -151,7 +204,13 @@ void sendMessage(SOCKET clientSocket) {
 }
 
 void listChatRooms(SOCKET clientSocket) {
-    std::string request = "LIST:\n";
+    std::string sortOrder, filter;
+    std::cout << "Sort by (name/members/activity): ";
+    std::getline(std::cin, sortOrder);
+    std::cout << "Filter (blank for all, ^prefix or substring): ";
+    std::getline(std::cin, filter);
+
+    std::string request = "LIST:" + sortOrder + ":" + filter + "\n";
     sendRequest(clientSocket, request);
 
     std::string response = receiveResponse(clientSocket);
@@ -159,15 +218,13 @@ void listChatRooms(SOCKET clientSocket) {
 }
 
 void kickUser(SOCKET clientSocket) {
-    std::string roomName;
-    SOCKET targetSocket;
+    std::string roomName, targetUsername;
     std::cout << "Enter chat room name: ";
     std::getline(std::cin, roomName);
-    std::cout << "Enter target user socket: ";
-    std::cin >> targetSocket;
-    std::cin.ignore(); // Ignore newline character
+    std::cout << "Enter target username: ";
+    std::getline(std::cin, targetUsername);
 
-    std::string request = "KICK_USER:" + roomName + ":" + std::to_string(targetSocket) + "\n";
+    std::string request = "KICK_USER:" + roomName + ":" + targetUsername + "\n";
     sendRequest(clientSocket, request);
 
     std::string response = receiveResponse(clientSocket);
@@ -175,15 +232,13 @@ void kickUser(SOCKET clientSocket) {
 }
 
 void banUser(SOCKET clientSocket) {
-    std::string roomName;
-    SOCKET targetSocket;
+    std::string roomName, targetUsername;
     std::cout << "Enter chat room name: ";
     std::getline(std::cin, roomName);
-    std::cout << "Enter target user socket: ";
-    std::cin >> targetSocket;
-    std::cin.ignore(); // Ignore newline character
+    std::cout << "Enter target username: ";
+    std::getline(std::cin, targetUsername);
 
-    std::string request = "BAN_USER:" + roomName + ":" + std::to_string(targetSocket) + "\n";
+    std::string request = "BAN_USER:" + roomName + ":" + targetUsername + "\n";
     sendRequest(clientSocket, request);
 
     std::string response = receiveResponse(clientSocket);
@@ -191,15 +246,13 @@ void banUser(SOCKET clientSocket) {
 }
 
 void grantModeratorRights(SOCKET clientSocket) {
-    std::string roomName;
-    SOCKET targetSocket;
+    std::string roomName, targetUsername;
     std::cout << "Enter chat room name: ";
     std::getline(std::cin, roomName);
-    std::cout << "Enter target user socket: ";
-    std::cin >> targetSocket;
-    std::cin.ignore(); // Ignore newline character
+    std::cout << "Enter target username: ";
+    std::getline(std::cin, targetUsername);
 
-    std::string request = "GRANT_MODERATOR:" + roomName + ":" + std::to_string(targetSocket) + "\n";
+    std::string request = "GRANT_MODERATOR:" + roomName + ":" + targetUsername + "\n";
     sendRequest(clientSocket, request);
 
     std::string response = receiveResponse(clientSocket);
@@ -207,15 +260,13 @@ void grantModeratorRights(SOCKET clientSocket) {
 }
 
 void revokeModeratorRights(SOCKET clientSocket) {
-    std::string roomName;
-    SOCKET targetSocket;
+    std::string roomName, targetUsername;
     std::cout << "Enter chat room name: ";
     std::getline(std::cin, roomName);
-    std::cout << "Enter target user socket: ";
-    std::cin >> targetSocket;
-    std::cin.ignore(); // Ignore newline character
+    std::cout << "Enter target username: ";
+    std::getline(std::cin, targetUsername);
 
-    std::string request = "REVOKE_MODERATOR:" + roomName + ":" + std::to_string(targetSocket) + "\n";
+    std::string request = "REVOKE_MODERATOR:" + roomName + ":" + targetUsername + "\n";
     sendRequest(clientSocket, request);
 
     std::string response = receiveResponse(clientSocket);
@@ -231,13 +282,13 @@ void showProfile(SOCKET clientSocket) {
 }
 
 void updateProfile(SOCKET clientSocket) {
-    std::string username, password;
-    std::cout << "Enter new username: ";
-    std::getline(std::cin, username);
-    std::cout << "Enter new password: ";
-    std::getline(std::cin, password);
+    std::string profilePicture, statusMessage;
+    std::cout << "Enter new profile picture: ";
+    std::getline(std::cin, profilePicture);
+    std::cout << "Enter new status message: ";
+    std::getline(std::cin, statusMessage);
 
-    std::string request = "UPDATE_PROFILE:" + username + ":" + password + "\n";
+    std::string request = "UPDATE_PROFILE:" + profilePicture + ":" + statusMessage + "\n";
     sendRequest(clientSocket, request);
 
     std::string response = receiveResponse(clientSocket);
@@ -272,21 +323,66 @@ void getFile(SOCKET clientSocket) {
     std::cout << response << std::endl;
 }
 
-int main() {
-    SOCKET clientSocket = connectToServer();
-    if (clientSocket == INVALID_SOCKET) {
+void setPresence(SOCKET clientSocket) {
+    std::string state;
+    std::cout << "Enter presence (online/away): ";
+    std::getline(std::cin, state);
+
+    std::string request = "PRESENCE:" + state + "\n";
+    sendRequest(clientSocket, request);
+
+    std::string response = receiveResponse(clientSocket);
+    std::cout << response << std::endl;
+}
+
+void searchChatRoom(SOCKET clientSocket) {
+    std::string roomName, query;
+    std::cout << "Enter chat room name: ";
+    std::getline(std::cin, roomName);
+    std::cout << "Enter search terms: ";
+    std::getline(std::cin, query);
+
+    std::string request = "SEARCH:" + roomName + ":" + query + "\n";
+    sendRequest(clientSocket, request);
+
+    std::string response = receiveResponse(clientSocket);
+    std::cout << response << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    // An optional argument selects the server port, e.g. to reach another cluster node
+    int port = argc > 1 ? std::atoi(argv[1]) : SERVER_PORT;
+
+    // Initialize Winsock
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        std::cerr << "Failed to initialize Winsock." << std::endl;
         return 1;
     }
 
+    SOCKET clientSocket = INVALID_SOCKET;
     std::string option;
     while (true) {
         printMenu();
         std::getline(std::cin, option);
 
         if (option == "1") {
-            registerUser(clientSocket);
+            registerUser(port);
         } else if (option == "2") {
-            loginUser(clientSocket);
+            if (clientSocket != INVALID_SOCKET) {
+                std::cout << "Already logged in." << std::endl;
+                continue;
+            }
+            clientSocket = loginUser(port);
+            if (clientSocket != INVALID_SOCKET) {
+                // Heartbeats are only accepted once the handshake has completed
+                std::thread heartbeatThread(sendHeartbeats, clientSocket);
+                heartbeatThread.detach();
+            }
+        } else if (option == "17") {
+            break;
+        } else if (clientSocket == INVALID_SOCKET) {
+            std::cout << "Please log in first." << std::endl;
         } else if (option == "3") {
             joinChatRoom(clientSocket);
         } else if (option == "4") {
@@ -312,13 +408,17 @@ int main() {
         } else if (option == "14") {
             getFile(clientSocket);
         } else if (option == "15") {
-            break;
+            setPresence(clientSocket);
+        } else if (option == "16") {
+            searchChatRoom(clientSocket);
         } else {
             std::cout << "Invalid option. Please try again." << std::endl;
         }
     }
 
-    closesocket(clientSocket);
+    if (clientSocket != INVALID_SOCKET) {
+        closesocket(clientSocket);
+    }
     WSACleanup();
 
     return 0;
@@ -5,517 +5,5026 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <algorithm>
+#include <cctype>
+#include <climits>
 #include <fstream>
 #include <sstream>
 #include <winsock2.h>
+#include <windows.h>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <functional> 
+#include <chrono>
+#include <set>
+#include <map>
+#include <deque>
+#include <memory>
+#include <cmath>
+#include <cstdint>
+#include <array>
+#include <cstdio>
+#include <atomic>
+#include <csignal>
+#include <future>
 
 #pragma comment(lib, "ws2_32.lib") // Link with the Windows Sockets Library (WS2_32)
 
 const int BUFFER_SIZE = 4096;
-const int MAX_CLIENTS = 10;
+const int MAX_CLIENTS = 1000;                   // Concurrent connections before new ones are refused
 const std::string USER_DATABASE_FILE = "user_database.txt";
 const std::string FILE_STORAGE_DIRECTORY = "file_storage/";
+const int PRESENCE_FLUSH_INTERVAL_MS = 250;      // Minimum gap between presence broadcasts to one room
+const int PRESENCE_SNAPSHOT_INTERVAL_MS = 30000; // Full presence snapshot period per room
+const int TYPING_TIMEOUT_MS = 5000;              // Typing indicator expires after this much silence
+const size_t ROOM_LIST_PAGE_SIZE = 50;
+const size_t ROOM_LIST_CACHE_LIMIT = 256;        // Serialized LIST pages kept per sort order
+const size_t ROOM_LIST_SORT_LIMIT = 1000;        // Filter candidates sorted directly instead of walking the sort order
+const size_t ROOM_LIST_SCAN_LIMIT = 10000;       // Rooms one filtered LIST page examines at most
+const size_t SEARCH_SEGMENT_MESSAGES = 1024;     // Messages buffered before the live index is sealed
+const size_t SEARCH_RESULT_LIMIT = 20;
+const size_t SEARCH_MAX_TERM_LENGTH = 32;
+const double USER_MESSAGE_RATE_PER_SECOND = 5.0; // Sustained room messages per user
+const double USER_MESSAGE_BURST = 10.0;
+const double IP_CONNECT_RATE_PER_SECOND = 2.0;   // New connections per client address
+const double IP_CONNECT_BURST = 10.0;
+const double USER_COMMAND_RATE_PER_SECOND = 20.0; // Commands of any kind per user
+const double USER_COMMAND_BURST = 40.0;
+const double ROOM_MESSAGE_RATE_PER_SECOND = 100.0; // Messages into one room from all its members
+const double ROOM_MESSAGE_BURST = 200.0;
+const double ROOM_CREATE_RATE_PER_SECOND = 0.1;  // New rooms per user
+const double ROOM_CREATE_BURST = 5.0;
+const size_t MAX_ROOMS = 100000;
+const size_t MEMORY_BUDGET_BYTES = 256u << 20;   // Retained message history and its search postings across all rooms
+const int MAX_COMMANDS_IN_FLIGHT = 64;           // Commands executing at once before new ones are shed
+const int RATE_LIMIT_PRUNE_INTERVAL_MS = 60000;
+const uint32_t UNREAD_REPLAY_LIMIT = 100;        // Unread messages replayed per room on login
+const uint32_t GAP_FILL_LIMIT = 500;             // Messages resent per GAP request
+const size_t DEFAULT_LARGE_ROOM_THRESHOLD = 20000; // Members at which a room switches to tiered fan-out
+const unsigned FANOUT_WORKER_COUNT = 4;
+const size_t MAX_FANOUT_QUEUE_BYTES = 8u << 20;  // Large-room messages waiting per fan-out worker
+const int CLIENT_SEND_TIMEOUT_MS = 5000;         // Sends blocked longer than this fail
+const int FILTER_ALPHABET_SIZE = 37;             // Word separator, digits and case-folded letters
+const std::string SNAPSHOT_FILE = "server_state.snap";
+const int SNAPSHOT_INTERVAL_SECONDS = 30;
+const uint32_t SNAPSHOT_FORMAT_VERSION = 3;      // 2 added read cursors, 3 the evicted history count
+const int DEFAULT_SERVER_PORT = 8888;
+const int DEFAULT_BENCH_CLUSTER_PORT = 7400;     // First cluster port used by --bench cluster
+const SOCKET MAX_BENCH_SESSIONS = 256;           // Fake sessions whose echoes a benchmark can track
+const int CLUSTER_VIRTUAL_NODES = 64;            // Ring points per node for consistent hashing
+const int CLUSTER_RECONNECT_DELAY_MS = 1000;
+const size_t MAX_CLUSTER_OUTBOX_BYTES = 16u << 20; // Frames queued for a peer before its link is reset and resynced
+const int TIMER_TICK_MS = 10;
+const int TIMER_WHEEL_BITS = 6;
+const int TIMER_WHEEL_SLOTS = 1 << TIMER_WHEEL_BITS;
+const int TIMER_WHEEL_LEVELS = 4;                // 64^4 ticks, about 46 hours at 10 ms
+const int HANDSHAKE_TIMEOUT_MS = 10000;          // New connections must log in within this
+const int MAX_HANDSHAKE_REQUESTS = 4;            // Registrations and login attempts allowed before a login succeeds
+const int HEARTBEAT_INTERVAL_MS = 30000;         // Silent connections are sent a PING after this
+const int IDLE_TIMEOUT_MS = 90000;               // Silent connections are closed after this
+const int DRAIN_TIMEOUT_MS = 5000;               // Grace period for clients on shutdown
+const int SHUTDOWN_POLL_MS = 100;
+const size_t MAX_COMMAND_LENGTH = 1 << 20;       // Longest unterminated command a client may buffer
 
 struct Client {
     SOCKET socket;
     std::string username;
     std::string profilePicture;
     std::string statusMessage;
-    bool hasUnreadMessages;
+};
+
+enum class RoomRole { Member, Moderator, Owner };
+
+// Aho-Corasick automaton over a room's banned words, compiled into a dense DFA so
+// checking a message is one table lookup per character. Every word is padded with
+// separators on both sides, which makes all matches whole-word matches.
+struct ContentFilter {
+    std::vector<std::array<int, FILTER_ALPHABET_SIZE>> transitions;
+    std::vector<bool> accepting;
+};
+
+struct TokenBucket {
+    double tokens;
+    std::chrono::steady_clock::time_point lastRefill;
+};
+
+struct UserProfile {
+    std::string profilePicture;
+    std::string statusMessage;
+};
+
+// History entries are shared with the snapshot writer, so a snapshot does not
+// hold a second copy of every message.
+typedef std::shared_ptr<const std::string> HistoryEntry;
+
+// A message waiting to be sent to a small room's members outside clientsMutex.
+struct RoomDelivery {
+    HistoryEntry message;
+    std::vector<SOCKET> recipients;
+    std::vector<SOCKET> pinned; // Recipients whose connections stay open until the send
 };
 
 struct ChatRoom {
     std::string name;
     std::unordered_set<SOCKET> members;
-    std::vector<std::string> messageHistory;
+    std::deque<HistoryEntry> messageHistory;
+    uint32_t historyBase; // Messages evicted from the front of messageHistory
+    std::unordered_map<std::string, RoomRole> roles;
+    std::unordered_set<std::string> bannedUsers;
+    std::set<std::string> filterWords;
+    std::shared_ptr<const ContentFilter> contentFilter;
+    bool largeRoom;
+    std::deque<RoomDelivery> pendingDeliveries; // Direct deliveries in sequence order
+    bool delivering;                            // A thread is sending pendingDeliveries
 };
 
 std::vector<Client> clients;
 std::unordered_map<std::string, std::string> userCredentials;
 std::unordered_map<std::string, ChatRoom> chatRooms;
+std::unordered_map<SOCKET, std::string> socketUsernames;
+std::unordered_map<std::string, SOCKET> usernameSockets;
+std::unordered_map<std::string, TokenBucket> userMessageBuckets;
+std::unordered_map<std::string, TokenBucket> ipConnectBuckets;
+std::unordered_map<std::string, TokenBucket> userCommandBuckets;
+std::unordered_map<std::string, TokenBucket> roomMessageBuckets;
+std::unordered_map<std::string, TokenBucket> roomCreateBuckets;
+// A retained message and the bytes charged for it against MEMORY_BUDGET_BYTES.
+struct RetainedMessage {
+    ChatRoom* room;
+    size_t bytes;
+};
+
+std::atomic<size_t> retainedHistoryBytes(0);
+std::deque<RetainedMessage> historyEvictionOrder; // Every retained message, oldest first
+std::atomic<int> commandsInFlight(0);
+std::unordered_map<std::string, UserProfile> savedProfiles;
+std::unordered_map<std::string, std::vector<std::string>> restoredMemberships;
+std::unordered_map<std::string, std::unordered_map<std::string, uint32_t>> readCursors; // username -> room -> last acknowledged sequence
+std::unordered_map<std::string, bool> snapshotDirtyRooms;  // Changed since the last snapshot -> more than the history changed
+std::unordered_set<std::string> snapshotDirtyUsers;         // Profile, read cursors or restored rooms changed
+std::mutex rateLimitMutex;
 std::mutex clientsMutex;
 std::condition_variable clientCV;
 
+// Presence is tracked per room and keyed by username. Changes are coalesced into
+// 'pending' and broadcast at most once per PRESENCE_FLUSH_INTERVAL_MS per room, so
+// a burst of typing/away updates costs one broadcast instead of one per change.
+// Flushes, typing expiry and periodic snapshots are timer wheel entries that hand
+// due rooms to the presence thread, so idle rooms cost nothing per tick.
+enum class PresenceState { Offline, Online, Away, Typing };
+
+struct RoomPresence {
+    std::unordered_map<std::string, PresenceState> states;
+    std::unordered_set<std::string> pending;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> typingDeadlines;
+    std::chrono::steady_clock::time_point lastFlush;
+    uint64_t generation;  // Identifies this room's snapshot timer chain
+    bool snapshotDue;
+};
+
+std::unordered_map<std::string, RoomPresence> roomPresence;
+std::unordered_map<std::string, PresenceState> userPresence;
+std::unordered_map<std::string, std::unordered_set<std::string>> userPresenceRooms;
+std::unordered_map<std::string, std::string> presenceStatusMessages;
+std::unordered_set<std::string> dirtyPresenceRooms;   // Rooms with a flush scheduled or queued
+std::deque<std::string> presenceFlushQueue;           // Rooms due for a broadcast
+uint64_t nextPresenceGeneration = 1;
+std::mutex presenceMutex;
+std::condition_variable presenceCV;
+
+// The room index keeps every room in one ordered set per sort order so LIST can
+// seek straight to a cursor instead of walking all rooms. A sort key is
+// (rank, name) where rank is 0 for name order and the negated member count or
+// activity stamp otherwise, which makes larger values sort first.
+enum class RoomSortOrder { Name, Members, Activity };
+const int ROOM_SORT_ORDER_COUNT = 3;
+
+typedef std::pair<long long, std::string> RoomSortKey;
+
+struct RoomIndexEntry {
+    long long memberCount;
+    long long lastActivity;
+};
+
+// A cached page covers the keys after 'cursor' up to and including 'last'.
+struct CachedRoomPage {
+    RoomSortKey last;
+    bool reachedEnd;
+    std::string text;
+};
+
+std::unordered_map<std::string, RoomIndexEntry> roomIndex;
+std::set<RoomSortKey> roomOrder[ROOM_SORT_ORDER_COUNT];
+std::map<RoomSortKey, CachedRoomPage> roomPageCache[ROOM_SORT_ORDER_COUNT];
+std::unordered_map<std::string, std::unordered_set<std::string>> roomTrigrams;
+std::set<std::pair<std::string, std::string>> roomFoldedNames; // (lower-cased name, name) for prefix filters
+long long roomActivityClock = 0;
+std::mutex roomIndexMutex;
+
+// Full-text search keeps one inverted index per room. Appends go into a small
+// uncompressed live buffer; full buffers are frozen and handed to a background
+// worker that seals them into immutable segments with varint-compressed posting
+// lists and merges segments of similar size, so the send path only tokenizes.
+typedef std::vector<std::pair<uint32_t, uint32_t>> SearchPostings; // (sequence, term frequency)
+
+// Buffers and segments each cover the consecutive messages from firstSequence on.
+struct SearchBuffer {
+    std::unordered_map<std::string, SearchPostings> terms;
+    uint32_t firstSequence;
+    size_t messageCount;
+};
+
+struct SearchSegment {
+    std::unordered_map<std::string, std::string> postings; // Delta-encoded (sequence, frequency) varints
+    uint32_t firstSequence;
+    size_t messageCount;
+};
+
+struct RoomSearchIndex {
+    std::mutex mutex;
+    std::shared_ptr<SearchBuffer> live;
+    std::deque<std::shared_ptr<const SearchBuffer>> frozen;
+    std::vector<std::shared_ptr<const SearchSegment>> segments;
+    uint32_t firstSequence;         // Oldest message still indexed
+    size_t messageCount;            // Messages indexed from firstSequence on
+    uint32_t firstRetainedSequence; // Oldest message not yet evicted from the room's history
+    bool prunePending;              // Queued for the search worker to drop evicted postings
+};
+
+std::unordered_map<std::string, std::shared_ptr<RoomSearchIndex>> roomSearchIndexes;
+std::mutex roomSearchIndexesMutex;
+std::deque<std::shared_ptr<RoomSearchIndex>> searchWorkQueue;
+std::mutex searchWorkMutex;
+std::condition_variable searchWorkCV;
+
+// Cluster mode. Rooms are partitioned across nodes with a consistent hash ring;
+// the owning node sequences a room's messages and keeps its history, and fans
+// each message out to the nodes that have subscribed because they hold local
+// members. Each node keeps one outbound link per peer whose frames are batched
+// into a single send whenever the link is busy. The owner also keeps the room's
+// roles, bans and content filter, so joins, moderation commands and messages
+// from other nodes are decided there. Inbound links are accepted only
+// from the configured peers' addresses and must open with a Hello naming that
+// peer and carrying the shared cluster key.
+enum class ClusterFrameType {
+    Hello, RoomMessage, Deliver, Subscribe, Unsubscribe, PrivateMessage, UserOnline, UserOffline,
+    RoomJoin, JoinAccepted, Moderate, RemoveMember, Notice
+};
+
+struct ClusterPeer {
+    std::string nodeId;
+    std::string host;
+    unsigned long address;
+    int port;
+    std::string outbox;
+    bool overflowed = false;                // Outbox dropped; the link must reconnect and resync
+    SOCKET socket = INVALID_SOCKET;         // Current outbound link, guarded by 'mutex'
+    std::mutex mutex;
+    std::condition_variable outboxCV;
+};
+
+bool clusterEnabled = false;
+std::string localNodeId;
+std::string clusterKey;
+unsigned long clusterBindAddress = INADDR_ANY;
+std::map<uint32_t, std::string> clusterRing;
+std::unordered_map<std::string, std::shared_ptr<ClusterPeer>> clusterPeers;
+std::unordered_map<std::string, std::string> userDirectory;                           // username -> node
+std::unordered_map<std::string, std::unordered_set<std::string>> roomSubscribers;     // owned room -> nodes
+std::unordered_set<std::string> subscribedRooms;                                      // remote rooms with local members
+std::unordered_map<std::string, uint64_t> peerLinkGenerations;                        // node -> latest inbound link
+std::mutex clusterMutex;
+std::string snapshotFile = SNAPSHOT_FILE;
+std::mutex snapshotMutex;
+
+// Replay and fuzzing drive the command handlers without sockets, disk writes or
+// background threads. Output to clients then goes to 'clientOutputSink' and rate
+// limits are off, so a capture replays the same way every time. Benchmarks use
+// the same mode with the background threads running, and may turn rate limits
+// back on with 'benchRateLimits'.
+bool replayMode = false;
+bool benchRateLimits = false;
+std::function<void(SOCKET, const char*, int)> clientOutputSink;
+std::string trafficRecordFile;
+std::string trafficReplayFile;
+std::string benchmarkName;
+std::ofstream trafficRecord;
+std::mutex trafficRecordMutex;
+
+// Hierarchical timer wheel. Level 0 has one slot per tick and every level above
+// covers a whole revolution of the level below in each slot. Timers are intrusive
+// list nodes, so scheduling and cancelling are O(1); when a level wraps, the next
+// slot of the level above is cascaded down. Connections use it for handshake
+// deadlines, heartbeats and idle timeouts, which are re-armed lazily from the
+// last activity time instead of being rescheduled on every receive.
+struct TimerEntry {
+    uint64_t id;
+    uint64_t expiryTick;
+    std::function<void()> callback;
+    TimerEntry* prev;
+    TimerEntry* next;
+    int level;
+    int slot;
+};
+
+TimerEntry* timerSlots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+std::unordered_map<uint64_t, std::unique_ptr<TimerEntry>> activeTimers;
+uint64_t timerCurrentTick = 0;
+uint64_t nextTimerId = 1;
+std::mutex timerMutex;
+
+struct Connection {
+    uint64_t id;
+    uint64_t handshakeTimer;
+    uint64_t idleTimer;
+    uint64_t heartbeatTimer;
+    std::chrono::steady_clock::time_point lastActivity;
+    std::string address;
+    int pins;                               // Timer callbacks and room deliveries using the socket outside connectionsMutex
+};
+
+std::unordered_map<SOCKET, Connection> connections;
+std::unordered_map<SOCKET, std::unordered_set<std::string>> socketRooms; // Guarded by clientsMutex
+uint64_t nextConnectionId = 1;
+std::atomic<bool> shutdownRequested(false);
+std::mutex connectionsMutex;
+std::condition_variable connectionsCV;
+
+// Tiered fan-out. Once a room reaches largeRoomThreshold members its membership
+// is also partitioned across the fan-out workers, each connection always landing
+// on the same worker. A message to a large room is then one task per worker that
+// shares a single encoded buffer, and the workers send their slices in parallel
+// instead of the publishing thread walking every member. Membership changes are
+// queued in the same order as deliveries, and the room drops back to direct
+// delivery when it shrinks below half the threshold. Queued deliveries are capped
+// per worker; past the cap messages are dropped for that slice and members can
+// fetch them with GAP. A member whose send times out is disconnected so one slow
+// reader cannot stall its worker. The default threshold is where "--bench fanout"
+// shows tiered delivery reaching the last member sooner at both p50 and p99;
+// below about 10000 members the extra hand-off costs more than it saves.
+enum class FanoutTaskType { Join, Leave, DropRoom, Deliver, Barrier };
+
+struct FanoutTask {
+    FanoutTaskType type;
+    std::string roomName;
+    SOCKET member;
+    std::shared_ptr<const std::string> message;
+    std::shared_ptr<std::promise<void>> done;
+};
+
+struct FanoutWorker {
+    std::deque<FanoutTask> tasks;
+    size_t queuedBytes = 0; // Messages of the Deliver tasks in 'tasks'
+    std::mutex mutex;
+    std::condition_variable tasksCV;
+    std::unordered_map<std::string, std::unordered_set<SOCKET>> rooms; // Only touched while applying tasks
+    std::unordered_set<SOCKET> laggards; // Members shut down after a failed send; only touched while applying tasks
+};
+
+std::vector<std::unique_ptr<FanoutWorker>> fanoutWorkers;
+bool fanoutThreadsRunning = false;
+size_t largeRoomThreshold = DEFAULT_LARGE_ROOM_THRESHOLD;
+
+int sendToClient(SOCKET clientSocket, const char* data, int length) {
+    if (clientOutputSink) {
+        clientOutputSink(clientSocket, data, length);
+        return length;
+    }
+    return send(clientSocket, data, length, 0);
+}
+
 void broadcastMessage(const std::string& message, const std::unordered_set<SOCKET>& recipients, SOCKET senderSocket) {
     for (SOCKET recipientSocket : recipients) {
         if (recipientSocket != senderSocket) {
-            send(recipientSocket, message.c_str(), static_cast<int>(message.length()), 0);
+            sendToClient(recipientSocket, message.c_str(), static_cast<int>(message.length()));
         }
     }
 }
 
-void joinChatRoom(const std::string& roomName, SOCKET clientSocket) {
-    if (chatRooms.count(roomName) == 0) {
-        chatRooms[roomName] = ChatRoom{ roomName };
+void appendVarint(std::string& out, uint32_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
     }
+    out += static_cast<char>(value);
+}
+
+uint32_t readVarint(const std::string& in, size_t& pos) {
+    uint32_t value = 0;
+    for (int shift = 0; pos < in.size() && shift < 35; shift += 7) {
+        unsigned char byte = static_cast<unsigned char>(in[pos++]);
+        value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+    }
+    return value;
+}
 
-    chatRooms[roomName].members.insert(clientSocket);
+void appendEncodedString(std::string& out, const std::string& value) {
+    appendVarint(out, static_cast<uint32_t>(value.size()));
+    out += value;
 }
 
-void leaveChatRoom(const std::string& roomName, SOCKET clientSocket) {
-    if (chatRooms.count(roomName) != 0) {
-        chatRooms[roomName].members.erase(clientSocket);
+bool readEncodedCount(const std::string& in, size_t& pos, uint32_t& value) {
+    if (pos >= in.size()) {
+        return false;
     }
+    value = readVarint(in, pos);
+    return pos <= in.size();
 }
 
-bool clientSocketMatches(const Client& client, SOCKET clientSocket) {
-    return client.socket == clientSocket;
+bool readEncodedString(const std::string& in, size_t& pos, std::string& value) {
+    uint32_t length;
+    if (!readEncodedCount(in, pos, length) || length > in.size() - pos) {
+        return false;
+    }
+    value = in.substr(pos, length);
+    pos += length;
+    return true;
 }
 
-void sendNotificationToClient(const std::string& message, SOCKET clientSocket) {
-    std::string notification = "[Notification] " + message + "\n";
-    send(clientSocket, notification.c_str(), static_cast<int>(notification.length()), 0);
+std::string toLowerCase(const std::string& text) {
+    std::string lowered(text);
+    std::transform(lowered.begin(), lowered.end(), lowered.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return lowered;
 }
 
-bool authenticateUser(const std::string& username, const std::string& password) {
-    if (userCredentials.count(username) != 0) {
-        return userCredentials[username] == password;
+std::vector<std::string> roomNameTrigrams(const std::string& roomName) {
+    std::vector<std::string> trigrams;
+    std::string lowered = toLowerCase(roomName);
+    for (size_t i = 0; i + 3 <= lowered.size(); ++i) {
+        trigrams.push_back(lowered.substr(i, 3));
     }
-    return false;
+    return trigrams;
 }
 
-void sendAuthenticationResponse(bool authenticated, SOCKET clientSocket) {
-    std::string response = authenticated ? "Authentication successful!\n" : "Authentication failed. Invalid credentials.\n";
-    send(clientSocket, response.c_str(), static_cast<int>(response.length()), 0);
+// Callers must hold roomIndexMutex.
+RoomSortKey roomSortKey(RoomSortOrder order, const std::string& roomName, const RoomIndexEntry& entry) {
+    switch (order) {
+    case RoomSortOrder::Members: return RoomSortKey(-entry.memberCount, roomName);
+    case RoomSortOrder::Activity: return RoomSortKey(-entry.lastActivity, roomName);
+    default: return RoomSortKey(0, roomName);
+    }
+}
+
+// Drops only the cached pages whose contents change when 'key' appears in or
+// disappears from the given order. Pages that end before the key are untouched,
+// as are pages that start after it, because pagination is keyed by cursor.
+// Callers must hold roomIndexMutex.
+void invalidateRoomPages(RoomSortOrder order, const RoomSortKey& key) {
+    auto& cache = roomPageCache[static_cast<int>(order)];
+    for (auto it = cache.begin(); it != cache.end() && it->first < key;) {
+        if (it->second.reachedEnd || !(it->second.last < key)) {
+            it = cache.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+// Callers must hold roomIndexMutex.
+void unlinkRoomFromOrders(const std::string& roomName, const RoomIndexEntry& entry) {
+    for (int order = 0; order < ROOM_SORT_ORDER_COUNT; ++order) {
+        RoomSortKey key = roomSortKey(static_cast<RoomSortOrder>(order), roomName, entry);
+        roomOrder[order].erase(key);
+        invalidateRoomPages(static_cast<RoomSortOrder>(order), key);
+    }
+}
+
+// Callers must hold roomIndexMutex.
+void linkRoomIntoOrders(const std::string& roomName, const RoomIndexEntry& entry) {
+    for (int order = 0; order < ROOM_SORT_ORDER_COUNT; ++order) {
+        RoomSortKey key = roomSortKey(static_cast<RoomSortOrder>(order), roomName, entry);
+        roomOrder[order].insert(key);
+        invalidateRoomPages(static_cast<RoomSortOrder>(order), key);
+    }
+}
+
+// Callers must hold clientsMutex, so member counts reach the index in the order
+// they changed.
+void indexRoomMemberCount(const std::string& roomName, size_t memberCount) {
+    std::lock_guard<std::mutex> lock(roomIndexMutex);
+    auto it = roomIndex.find(roomName);
+    if (it == roomIndex.end()) {
+        RoomIndexEntry entry = { static_cast<long long>(memberCount), ++roomActivityClock };
+        roomIndex[roomName] = entry;
+        linkRoomIntoOrders(roomName, entry);
+        for (const std::string& trigram : roomNameTrigrams(roomName)) {
+            roomTrigrams[trigram].insert(roomName);
+        }
+        roomFoldedNames.insert(std::make_pair(toLowerCase(roomName), roomName));
+        return;
+    }
+    if (it->second.memberCount == static_cast<long long>(memberCount)) {
+        return;
+    }
+    unlinkRoomFromOrders(roomName, it->second);
+    it->second.memberCount = static_cast<long long>(memberCount);
+    linkRoomIntoOrders(roomName, it->second);
+}
+
+void indexRoomActivity(const std::string& roomName) {
+    std::lock_guard<std::mutex> lock(roomIndexMutex);
+    auto it = roomIndex.find(roomName);
+    if (it == roomIndex.end()) {
+        return;
+    }
+    // Only the activity order moves; name and member order pages are unaffected.
+    auto& activityOrder = roomOrder[static_cast<int>(RoomSortOrder::Activity)];
+    RoomSortKey oldKey = roomSortKey(RoomSortOrder::Activity, roomName, it->second);
+    activityOrder.erase(oldKey);
+    invalidateRoomPages(RoomSortOrder::Activity, oldKey);
+    it->second.lastActivity = ++roomActivityClock;
+    RoomSortKey newKey = roomSortKey(RoomSortOrder::Activity, roomName, it->second);
+    activityOrder.insert(newKey);
+    invalidateRoomPages(RoomSortOrder::Activity, newKey);
+}
+
+std::string encodeRoomCursor(const RoomSortKey& key) {
+    return std::to_string(key.first) + "/" + key.second;
+}
+
+bool decodeRoomCursor(const std::string& cursor, RoomSortKey& key) {
+    size_t separatorPos = cursor.find('/');
+    if (separatorPos == std::string::npos) {
+        return false;
+    }
+    char* end = nullptr;
+    std::string rank = cursor.substr(0, separatorPos);
+    key.first = std::strtoll(rank.c_str(), &end, 10);
+    key.second = cursor.substr(separatorPos + 1);
+    return !rank.empty() && *end == '\0';
+}
+
+// Callers must hold roomIndexMutex.
+std::string formatRoomListEntry(const RoomSortKey& key) {
+    const RoomIndexEntry& entry = roomIndex[key.second];
+    return key.second + " (" + std::to_string(entry.memberCount) + " members)\n";
+}
+
+// Serializes one page of rooms following 'cursor'. A trailing NEXT: line carries
+// the cursor for the following page. Unfiltered pages are served from the cache.
+// Callers must hold roomIndexMutex.
+std::string buildRoomListPage(RoomSortOrder order, const RoomSortKey& cursor) {
+    auto& cache = roomPageCache[static_cast<int>(order)];
+    auto cached = cache.find(cursor);
+    if (cached != cache.end()) {
+        return cached->second.text;
+    }
+
+    const auto& keys = roomOrder[static_cast<int>(order)];
+    auto it = keys.upper_bound(cursor);
+    CachedRoomPage page = { cursor, false, "" };
+    size_t count = 0;
+    for (; it != keys.end() && count < ROOM_LIST_PAGE_SIZE; ++it, ++count) {
+        page.text += formatRoomListEntry(*it);
+        page.last = *it;
+    }
+    page.reachedEnd = it == keys.end();
+    if (!page.reachedEnd) {
+        page.text += "NEXT:" + encodeRoomCursor(page.last) + "\n";
+    }
+
+    if (cache.size() >= ROOM_LIST_CACHE_LIMIT) {
+        cache.clear();
+    }
+    cache[cursor] = page;
+    return page.text;
+}
+
+// Filters are case-insensitive. 'pattern' is already lower-cased.
+bool roomNameMatches(const std::string& roomName, const std::string& pattern, bool prefix) {
+    std::string lowered = toLowerCase(roomName);
+    return prefix ? lowered.compare(0, pattern.size(), pattern) == 0 : lowered.find(pattern) != std::string::npos;
+}
+
+// Collects the rooms that can match the filter. Returns false without collecting
+// when there are more than ROOM_LIST_SORT_LIMIT of them, or when a substring is
+// too short for the trigram index; the caller then walks the sort order instead.
+// Callers must hold roomIndexMutex.
+bool collectFilterCandidates(const std::string& pattern, bool prefix, std::vector<std::string>& candidates) {
+    if (prefix) {
+        for (auto it = roomFoldedNames.lower_bound(std::make_pair(pattern, std::string())); it != roomFoldedNames.end(); ++it) {
+            if (it->first.compare(0, pattern.size(), pattern) != 0) {
+                break;
+            }
+            if (candidates.size() == ROOM_LIST_SORT_LIMIT) {
+                return false;
+            }
+            candidates.push_back(it->second);
+        }
+        return true;
+    }
+    if (pattern.size() < 3) {
+        return false;
+    }
+    // The rarest trigram bounds the candidates; the substring is verified later
+    const std::unordered_set<std::string>* smallest = nullptr;
+    for (const std::string& trigram : roomNameTrigrams(pattern)) {
+        auto postings = roomTrigrams.find(trigram);
+        if (postings == roomTrigrams.end()) {
+            return true;
+        }
+        if (smallest == nullptr || postings->second.size() < smallest->size()) {
+            smallest = &postings->second;
+        }
+    }
+    if (smallest->size() > ROOM_LIST_SORT_LIMIT) {
+        return false;
+    }
+    candidates.assign(smallest->begin(), smallest->end());
+    return true;
 }
 
-std::string getChatRoomList() {
+// Serializes one page of rooms matching 'filter' after 'cursor'. Few candidates
+// are sorted directly; otherwise the sort order is walked from the cursor until
+// the page is full or ROOM_LIST_SCAN_LIMIT rooms were examined, so a page can be
+// short and still carry a NEXT: cursor. Either way the cost of a page does not
+// depend on the number of rooms. Callers must hold roomIndexMutex.
+std::string buildFilteredRoomListPage(RoomSortOrder order, const std::string& filter, const RoomSortKey& cursor) {
+    bool prefix = filter[0] == '^';
+    std::string pattern = toLowerCase(prefix ? filter.substr(1) : filter);
     std::string roomList;
-    for (const auto& chatRoom : chatRooms) {
-        roomList += chatRoom.second.name + "\n";
+    std::vector<std::string> candidates;
+    if (collectFilterCandidates(pattern, prefix, candidates)) {
+        std::vector<RoomSortKey> matches;
+        for (const std::string& name : candidates) {
+            RoomSortKey key = roomSortKey(order, name, roomIndex[name]);
+            if (cursor < key && roomNameMatches(name, pattern, prefix)) {
+                matches.push_back(key);
+            }
+        }
+        std::sort(matches.begin(), matches.end());
+        size_t count = std::min(matches.size(), ROOM_LIST_PAGE_SIZE);
+        for (size_t i = 0; i < count; ++i) {
+            roomList += formatRoomListEntry(matches[i]);
+        }
+        if (count < matches.size()) {
+            roomList += "NEXT:" + encodeRoomCursor(matches[count - 1]) + "\n";
+        }
+        return roomList;
+    }
+
+    const auto& keys = roomOrder[static_cast<int>(order)];
+    auto it = keys.upper_bound(cursor);
+    size_t count = 0;
+    size_t examined = 0;
+    RoomSortKey last = cursor;
+    for (; it != keys.end() && count < ROOM_LIST_PAGE_SIZE && examined < ROOM_LIST_SCAN_LIMIT; ++it, ++examined) {
+        last = *it;
+        if (roomNameMatches(it->second, pattern, prefix)) {
+            roomList += formatRoomListEntry(*it);
+            ++count;
+        }
+    }
+    if (it != keys.end()) {
+        roomList += "NEXT:" + encodeRoomCursor(last) + "\n";
     }
     return roomList;
 }
 
-bool isClientInChatRoom(const std::string& roomName, SOCKET clientSocket) {
-    if (chatRooms.count(roomName) != 0) {
-        const auto& members = chatRooms[roomName].members;
-        return members.count(clientSocket) != 0;
+std::string getChatRoomList(RoomSortOrder order, const std::string& filter, const std::string& cursorText) {
+    // The first page uses a cursor that sorts before every real key
+    RoomSortKey cursor(LLONG_MIN, "");
+    if (!cursorText.empty() && !decodeRoomCursor(cursorText, cursor)) {
+        cursor = RoomSortKey(LLONG_MIN, "");
+    }
+
+    std::lock_guard<std::mutex> lock(roomIndexMutex);
+    if (filter.empty()) {
+        return buildRoomListPage(order, cursor);
+    }
+    return buildFilteredRoomListPage(order, filter, cursor);
+}
+
+uint32_t hashClusterKey(const std::string& key) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (unsigned char c : key) {
+        hash = (hash ^ c) * 16777619u;
+    }
+    // FNV spreads short, similar keys poorly; finish with a murmur-style mix
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+void addClusterNode(const std::string& nodeId) {
+    for (int i = 0; i < CLUSTER_VIRTUAL_NODES; ++i) {
+        clusterRing[hashClusterKey(nodeId + "#" + std::to_string(i))] = nodeId;
+    }
+}
+
+std::string roomOwnerNode(const std::string& roomName) {
+    if (!clusterEnabled || clusterRing.empty()) {
+        return localNodeId;
+    }
+    auto it = clusterRing.lower_bound(hashClusterKey(roomName));
+    return it != clusterRing.end() ? it->second : clusterRing.begin()->second;
+}
+
+bool isRoomOwnedLocally(const std::string& roomName) {
+    return roomOwnerNode(roomName) == localNodeId;
+}
+
+std::string encodeClusterFrame(ClusterFrameType type, const std::vector<std::string>& fields) {
+    std::string payload;
+    appendVarint(payload, static_cast<uint32_t>(type));
+    for (const std::string& field : fields) {
+        appendEncodedString(payload, field);
+    }
+    std::string frame;
+    appendVarint(frame, static_cast<uint32_t>(payload.size()));
+    return frame + payload;
+}
+
+void queueClusterFrame(const std::string& nodeId, const std::string& frame) {
+    auto it = clusterPeers.find(nodeId);
+    if (it == clusterPeers.end()) {
+        return;
+    }
+    ClusterPeer& peer = *it->second;
+    std::lock_guard<std::mutex> lock(peer.mutex);
+    if (peer.overflowed) {
+        return;
+    }
+    if (peer.outbox.size() + frame.size() > MAX_CLUSTER_OUTBOX_BYTES) {
+        // A peer this far behind is reset and resynced rather than buffered for.
+        // Room messages lost with the outbox can be fetched again with GAP.
+        peer.outbox.clear();
+        peer.overflowed = true;
+        if (peer.socket != INVALID_SOCKET) {
+            shutdown(peer.socket, SD_BOTH);
+        }
+    }
+    else {
+        peer.outbox += frame;
+    }
+    peer.outboxCV.notify_one();
+}
+
+void broadcastClusterFrame(const std::string& frame) {
+    for (const auto& peer : clusterPeers) {
+        queueClusterFrame(peer.first, frame);
+    }
+}
+
+// Tells a remote room owner whether this node still needs the room's messages.
+// Callers must hold clientsMutex, so the decision follows the live member count
+// and subscribe and unsubscribe frames are queued in the order they were made.
+void updateRoomSubscription(const std::string& roomName, size_t memberCount) {
+    if (!clusterEnabled || isRoomOwnedLocally(roomName)) {
+        return;
+    }
+    bool subscribe;
+    {
+        std::lock_guard<std::mutex> lock(clusterMutex);
+        bool subscribed = subscribedRooms.count(roomName) != 0;
+        if ((memberCount > 0) == subscribed) {
+            return;
+        }
+        subscribe = memberCount > 0;
+        if (subscribe) {
+            subscribedRooms.insert(roomName);
+        }
+        else {
+            subscribedRooms.erase(roomName);
+        }
+    }
+    std::vector<std::string> fields = { roomName, localNodeId };
+    queueClusterFrame(roomOwnerNode(roomName), encodeClusterFrame(subscribe ? ClusterFrameType::Subscribe : ClusterFrameType::Unsubscribe, fields));
+}
+
+void applyFanoutTask(FanoutWorker& worker, FanoutTask& task) {
+    switch (task.type) {
+    case FanoutTaskType::Join:
+        worker.rooms[task.roomName].insert(task.member);
+        break;
+    case FanoutTaskType::Leave:
+        worker.rooms[task.roomName].erase(task.member);
+        break;
+    case FanoutTaskType::DropRoom:
+        worker.rooms.erase(task.roomName);
+        break;
+    case FanoutTaskType::Deliver: {
+        auto room = worker.rooms.find(task.roomName);
+        if (room != worker.rooms.end()) {
+            const std::string& message = *task.message;
+            for (SOCKET member : room->second) {
+                if (worker.laggards.count(member) != 0) {
+                    continue;
+                }
+                // The socket stays open until this worker passes the member's
+                // close barrier, so shutting it down here is safe
+                if (sendToClient(member, message.c_str(), static_cast<int>(message.length())) != static_cast<int>(message.length())) {
+                    worker.laggards.insert(member);
+                    shutdown(member, SD_BOTH);
+                }
+            }
+        }
+        break;
+    }
+    case FanoutTaskType::Barrier:
+        worker.laggards.erase(task.member);
+        task.done->set_value();
+        break;
+    }
+}
+
+void fanoutWorkerLoop(FanoutWorker* worker) {
+    std::deque<FanoutTask> batch;
+    size_t appliedBytes = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(worker->mutex);
+            worker->queuedBytes -= appliedBytes;
+            worker->tasksCV.wait(lock, [worker] { return !worker->tasks.empty(); });
+            batch.swap(worker->tasks);
+        }
+        appliedBytes = 0;
+        for (FanoutTask& task : batch) {
+            applyFanoutTask(*worker, task);
+            if (task.type == FanoutTaskType::Deliver) {
+                appliedBytes += task.message->size();
+            }
+        }
+        batch.clear();
     }
-    return false;
 }
 
-bool isUserModerator(const std::string& roomName, SOCKET clientSocket) {
-    if (chatRooms.count(roomName) != 0) {
-        const auto& members = chatRooms[roomName].members;
-        for (const auto& client : clients) {
-            if (client.socket == clientSocket && members.count(clientSocket) != 0) {
-                return true;
+// Creates the workers. Without threads, as in replay and fuzzing, tasks are
+// applied inline so delivery stays deterministic.
+void startFanoutWorkers(unsigned workerCount, bool startThreads) {
+    for (unsigned i = 0; i < workerCount; ++i) {
+        fanoutWorkers.push_back(std::unique_ptr<FanoutWorker>(new FanoutWorker()));
+    }
+    fanoutThreadsRunning = startThreads;
+    if (startThreads) {
+        for (auto& worker : fanoutWorkers) {
+            std::thread workerThread(fanoutWorkerLoop, worker.get());
+            workerThread.detach();
+        }
+    }
+}
+
+FanoutWorker& fanoutWorkerFor(SOCKET member) {
+    uint64_t mixed = static_cast<uint64_t>(member) * 0x9E3779B97F4A7C15ULL;
+    return *fanoutWorkers[(mixed >> 32) % fanoutWorkers.size()];
+}
+
+void queueFanoutTask(FanoutWorker& worker, const FanoutTask& task) {
+    if (!fanoutThreadsRunning) {
+        FanoutTask inlineTask = task;
+        applyFanoutTask(worker, inlineTask);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        // Membership changes and barriers are never dropped
+        if (task.type == FanoutTaskType::Deliver) {
+            if (worker.queuedBytes + task.message->size() > MAX_FANOUT_QUEUE_BYTES) {
+                return;
+            }
+            worker.queuedBytes += task.message->size();
+        }
+        worker.tasks.push_back(task);
+    }
+    worker.tasksCV.notify_one();
+}
+
+// Keeps the workers' partitions in step with a room's membership and promotes or
+// demotes the room. Caller holds clientsMutex and has already updated 'members'.
+void fanoutMembershipChanged(ChatRoom& chatRoom, SOCKET member, bool joined) {
+    if (fanoutWorkers.empty()) {
+        return;
+    }
+    if (!chatRoom.largeRoom) {
+        if (chatRoom.members.size() >= largeRoomThreshold) {
+            chatRoom.largeRoom = true;
+            for (SOCKET existing : chatRoom.members) {
+                queueFanoutTask(fanoutWorkerFor(existing), FanoutTask{ FanoutTaskType::Join, chatRoom.name, existing, nullptr, nullptr });
+            }
+        }
+        return;
+    }
+    if (chatRoom.members.size() < largeRoomThreshold / 2) {
+        chatRoom.largeRoom = false;
+        for (auto& worker : fanoutWorkers) {
+            queueFanoutTask(*worker, FanoutTask{ FanoutTaskType::DropRoom, chatRoom.name, INVALID_SOCKET, nullptr, nullptr });
+        }
+        return;
+    }
+    queueFanoutTask(fanoutWorkerFor(member), FanoutTask{ joined ? FanoutTaskType::Join : FanoutTaskType::Leave, chatRoom.name, member, nullptr, nullptr });
+}
+
+// Hands a message for a large room to every worker. Caller holds clientsMutex,
+// which keeps deliveries in sequence order.
+void fanoutRoomMessage(const ChatRoom& chatRoom, const std::string& fullMessage) {
+    std::shared_ptr<const std::string> message = std::make_shared<const std::string>(fullMessage);
+    for (auto& worker : fanoutWorkers) {
+        queueFanoutTask(*worker, FanoutTask{ FanoutTaskType::Deliver, chatRoom.name, INVALID_SOCKET, message, nullptr });
+    }
+}
+
+// Waits until the connection's worker has applied everything queued so far. After
+// the connection has left its rooms nothing more is sent to it, so its socket can
+// be closed without a late delivery reaching whoever reuses the socket number.
+// Sends time out, so a stuck reader delays the barrier but cannot block it.
+void flushFanoutDeliveries(SOCKET clientSocket) {
+    if (!fanoutThreadsRunning) {
+        return;
+    }
+    std::shared_ptr<std::promise<void>> done = std::make_shared<std::promise<void>>();
+    std::future<void> flushed = done->get_future();
+    queueFanoutTask(fanoutWorkerFor(clientSocket), FanoutTask{ FanoutTaskType::Barrier, "", clientSocket, nullptr, done });
+    flushed.wait();
+}
+
+void unpinConnections(const std::vector<SOCKET>& sockets);
+
+// Queues a message for a room below the large-room threshold and pins the
+// members' connections so none can be closed and its number reused before the
+// send. Replayed and benchmark sessions have no connection and need no pin.
+// Returns true if the caller must drain the room's deliveries once it has
+// released clientsMutex. Callers must hold clientsMutex.
+bool queueRoomDelivery(ChatRoom& chatRoom, const HistoryEntry& message) {
+    RoomDelivery delivery;
+    delivery.message = message;
+    delivery.recipients.assign(chatRoom.members.begin(), chatRoom.members.end());
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        for (SOCKET member : delivery.recipients) {
+            auto it = connections.find(member);
+            if (it != connections.end()) {
+                ++it->second.pins;
+                delivery.pinned.push_back(member);
+            }
+        }
+    }
+    chatRoom.pendingDeliveries.push_back(std::move(delivery));
+    if (chatRoom.delivering) {
+        return false;
+    }
+    chatRoom.delivering = true;
+    return true;
+}
+
+// Sends the room's queued deliveries in order. One thread drains a room at a
+// time while the others only queue, so messages keep their sequence order and a
+// slow member never blocks anyone holding clientsMutex. As in the fan-out
+// workers, a member whose send times out is shut down, and later sends to it
+// fail at once.
+void drainRoomDeliveries(ChatRoom& chatRoom) {
+    while (true) {
+        RoomDelivery delivery;
+        {
+            std::lock_guard<std::mutex> lock(clientsMutex);
+            if (chatRoom.pendingDeliveries.empty()) {
+                chatRoom.delivering = false;
+                return;
+            }
+            delivery = std::move(chatRoom.pendingDeliveries.front());
+            chatRoom.pendingDeliveries.pop_front();
+        }
+        const std::string& message = *delivery.message;
+        for (SOCKET member : delivery.recipients) {
+            if (sendToClient(member, message.c_str(), static_cast<int>(message.length())) != static_cast<int>(message.length())) {
+                shutdown(member, SD_BOTH);
             }
         }
+        unpinConnections(delivery.pinned);
+    }
+}
+
+// Callers must hold clientsMutex.
+void markRoomForSnapshot(const std::string& roomName, bool metadataChanged) {
+    bool& metadata = snapshotDirtyRooms[roomName];
+    metadata = metadata || metadataChanged;
+}
+
+// Callers must hold clientsMutex.
+void markUserForSnapshot(const std::string& username) {
+    if (!username.empty()) {
+        snapshotDirtyUsers.insert(username);
+    }
+}
+
+// Sequence number of the newest message in a room.
+uint32_t lastRoomSequence(const ChatRoom& chatRoom) {
+    return chatRoom.historyBase + static_cast<uint32_t>(chatRoom.messageHistory.size());
+}
+
+// Returns null if the message was evicted or has not been sent yet.
+const std::string* findRoomMessage(const ChatRoom& chatRoom, uint32_t sequence) {
+    if (sequence <= chatRoom.historyBase || sequence > lastRoomSequence(chatRoom)) {
+        return nullptr;
+    }
+    return chatRoom.messageHistory[sequence - chatRoom.historyBase - 1].get();
+}
+
+// Bytes charged for a retained message: its text, its eviction order entry and
+// its search postings. Postings are counted at their unsealed size and with the
+// term text repeated for every message, so sealed segments cost less than this.
+size_t retainedMessageBytes(const std::string& fullMessage, const std::unordered_map<std::string, uint32_t>& searchTerms) {
+    size_t bytes = fullMessage.size() + sizeof(RetainedMessage);
+    for (const auto& term : searchTerms) {
+        bytes += term.first.size() + sizeof(SearchPostings::value_type);
+    }
+    return bytes;
+}
+
+// Appends a message to the room's history and charges it to the memory budget.
+// Callers must hold clientsMutex.
+void retainRoomMessage(ChatRoom& chatRoom, const HistoryEntry& entry, const std::unordered_map<std::string, uint32_t>& searchTerms) {
+    size_t bytes = retainedMessageBytes(*entry, searchTerms);
+    chatRoom.messageHistory.push_back(entry);
+    retainedHistoryBytes += bytes;
+    historyEvictionOrder.push_back(RetainedMessage{ &chatRoom, bytes });
+}
+
+void evictSearchPostings(const std::string& roomName, uint32_t firstSequence);
+
+// Drops the oldest messages across all rooms until the history fits in
+// MEMORY_BUDGET_BYTES again. Callers must hold clientsMutex.
+void evictRoomHistory() {
+    while (retainedHistoryBytes > MEMORY_BUDGET_BYTES && !historyEvictionOrder.empty()) {
+        RetainedMessage oldest = historyEvictionOrder.front();
+        historyEvictionOrder.pop_front();
+        retainedHistoryBytes -= oldest.bytes;
+        ChatRoom& chatRoom = *oldest.room;
+        chatRoom.messageHistory.pop_front();
+        ++chatRoom.historyBase;
+        markRoomForSnapshot(chatRoom.name, false);
+        evictSearchPostings(chatRoom.name, chatRoom.historyBase + 1);
+    }
+}
+
+// Creates a room this node owns on first use, with 'username' as its owner.
+// Returns false if the user is banned from the room. Callers must hold clientsMutex.
+bool admitRoomMember(const std::string& roomName, const std::string& username) {
+    if (chatRooms.count(roomName) == 0) {
+        chatRooms[roomName] = ChatRoom{ roomName };
+        if (!username.empty()) {
+            chatRooms[roomName].roles[username] = RoomRole::Owner;
+        }
+        markRoomForSnapshot(roomName, true);
+    }
+    return chatRooms[roomName].bannedUsers.count(username) == 0;
+}
+
+// Adds a connection to the room's local members and returns their number.
+// 'lastSequence' is the room's newest message, which a first join counts as read.
+// Callers must hold clientsMutex.
+size_t insertRoomMember(const std::string& roomName, SOCKET clientSocket, const std::string& username, uint32_t lastSequence) {
+    if (chatRooms.count(roomName) == 0) {
+        chatRooms[roomName] = ChatRoom{ roomName };
+    }
+    ChatRoom& chatRoom = chatRooms[roomName];
+    if (chatRoom.members.insert(clientSocket).second) {
+        fanoutMembershipChanged(chatRoom, clientSocket, true);
+    }
+    socketRooms[clientSocket].insert(roomName);
+    // Messages sent before a user first joined do not count as unread
+    if (!username.empty() && readCursors[username].count(roomName) == 0) {
+        readCursors[username][roomName] = lastSequence;
+        markUserForSnapshot(username);
+    }
+    markRoomForSnapshot(roomName, true);
+    return chatRoom.members.size();
+}
+
+// Joins a room this node owns. Returns false if the user is banned from the
+// room. Whoever creates a room owns it.
+bool joinChatRoom(const std::string& roomName, SOCKET clientSocket, const std::string& username) {
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    if (!admitRoomMember(roomName, username)) {
+        return false;
+    }
+    uint32_t lastSequence = lastRoomSequence(chatRooms[roomName]);
+    size_t memberCount = insertRoomMember(roomName, clientSocket, username, lastSequence);
+    indexRoomMemberCount(roomName, memberCount);
+    updateRoomSubscription(roomName, memberCount);
+    return true;
+}
+
+// Asks the owner of a room held by another node to admit the user. The owner
+// answers with JoinAccepted or a notice, and the join completes on its reply.
+void requestRoomJoin(const std::string& roomName, const std::string& username, bool rejoin) {
+    std::vector<std::string> fields = { roomName, username, rejoin ? "1" : "0" };
+    queueClusterFrame(roomOwnerNode(roomName), encodeClusterFrame(ClusterFrameType::RoomJoin, fields));
+}
+
+void leaveChatRoom(const std::string& roomName, SOCKET clientSocket) {
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    if (chatRooms.count(roomName) == 0) {
+        return;
+    }
+    if (chatRooms[roomName].members.erase(clientSocket) != 0) {
+        fanoutMembershipChanged(chatRooms[roomName], clientSocket, false);
+    }
+    socketRooms[clientSocket].erase(roomName);
+    auto username = socketUsernames.find(clientSocket);
+    if (username != socketUsernames.end()) {
+        readCursors[username->second].erase(roomName);
+        markUserForSnapshot(username->second);
+    }
+    markRoomForSnapshot(roomName, true);
+    size_t memberCount = chatRooms[roomName].members.size();
+    indexRoomMemberCount(roomName, memberCount);
+    updateRoomSubscription(roomName, memberCount);
+}
+
+// Drops a closed connection from every room it was still in. The rooms are
+// remembered so the user is put back into them, with their read cursors, on the
+// next login.
+void leaveAllChatRooms(SOCKET clientSocket, const std::string& username) {
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    auto joined = socketRooms.find(clientSocket);
+    if (joined == socketRooms.end()) {
+        return;
+    }
+    for (const std::string& roomName : joined->second) {
+        auto it = chatRooms.find(roomName);
+        if (it != chatRooms.end() && it->second.members.erase(clientSocket) != 0) {
+            fanoutMembershipChanged(it->second, clientSocket, false);
+            indexRoomMemberCount(roomName, it->second.members.size());
+            updateRoomSubscription(roomName, it->second.members.size());
+            markRoomForSnapshot(roomName, true);
+        }
+    }
+    if (!username.empty() && !joined->second.empty()) {
+        restoredMemberships[username].assign(joined->second.begin(), joined->second.end());
+        markUserForSnapshot(username);
+    }
+    socketRooms.erase(joined);
+}
+
+bool clientSocketMatches(const Client& client, SOCKET clientSocket) {
+    return client.socket == clientSocket;
+}
+
+void sendNotificationToClient(const std::string& message, SOCKET clientSocket) {
+    std::string notification = "[Notification] " + message + "\n";
+    sendToClient(clientSocket, notification.c_str(), static_cast<int>(notification.length()));
+}
+
+// Work refused by admission control is answered with an explicit overload line
+// so clients can back off instead of waiting on a reply that never comes.
+void sendOverloadResponse(SOCKET clientSocket, const std::string& reason) {
+    std::string response = "[Overload] " + reason + "\n";
+    sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+}
+
+std::string getUsernameForSocket(SOCKET clientSocket) {
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    auto it = socketUsernames.find(clientSocket);
+    return it != socketUsernames.end() ? it->second : "";
+}
+
+std::unordered_set<SOCKET> getChatRoomMembers(const std::string& roomName) {
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    auto it = chatRooms.find(roomName);
+    if (it != chatRooms.end()) {
+        return it->second.members;
+    }
+    return std::unordered_set<SOCKET>();
+}
+
+bool authenticateUser(const std::string& username, const std::string& password) {
+    if (userCredentials.count(username) != 0) {
+        return userCredentials[username] == password;
+    }
+    return false;
+}
+
+void sendAuthenticationResponse(bool authenticated, SOCKET clientSocket) {
+    std::string response = authenticated ? "Authentication successful!\n" : "Authentication failed. Invalid credentials.\n";
+    sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+}
+
+// Returns the room if 'clientSocket' is one of its members, without creating it.
+// Callers must hold clientsMutex.
+ChatRoom* findMemberChatRoom(const std::string& roomName, SOCKET clientSocket) {
+    auto it = chatRooms.find(roomName);
+    if (it == chatRooms.end() || it->second.members.count(clientSocket) == 0) {
+        return nullptr;
+    }
+    return &it->second;
+}
+
+bool isClientInChatRoom(const std::string& roomName, SOCKET clientSocket) {
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    return findMemberChatRoom(roomName, clientSocket) != nullptr;
+}
+
+// Callers must hold clientsMutex.
+RoomRole getRoomRole(const ChatRoom& chatRoom, const std::string& username) {
+    auto it = chatRoom.roles.find(username);
+    return it != chatRoom.roles.end() ? it->second : RoomRole::Member;
+}
+
+bool isUserModerator(const std::string& roomName, const std::string& username) {
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    auto it = chatRooms.find(roomName);
+    if (it == chatRooms.end() || username.empty()) {
+        return false;
+    }
+    return getRoomRole(it->second, username) >= RoomRole::Moderator;
+}
+
+bool consumeToken(TokenBucket& bucket, double ratePerSecond, double burst) {
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - bucket.lastRefill).count();
+    bucket.tokens = std::min(burst, bucket.tokens + elapsed * ratePerSecond);
+    bucket.lastRefill = now;
+    if (bucket.tokens < 1.0) {
+        return false;
+    }
+    bucket.tokens -= 1.0;
+    return true;
+}
+
+// Takes a token from the bucket for 'key', creating a full bucket on first use.
+bool admitToken(std::unordered_map<std::string, TokenBucket>& buckets, const std::string& key, double ratePerSecond, double burst) {
+    if (replayMode && !benchRateLimits) {
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(rateLimitMutex);
+    auto it = buckets.find(key);
+    if (it == buckets.end()) {
+        TokenBucket bucket = { burst, std::chrono::steady_clock::now() };
+        it = buckets.insert(std::make_pair(key, bucket)).first;
+    }
+    return consumeToken(it->second, ratePerSecond, burst);
+}
+
+bool admitUserMessage(const std::string& username) {
+    return admitToken(userMessageBuckets, username, USER_MESSAGE_RATE_PER_SECOND, USER_MESSAGE_BURST);
+}
+
+bool admitRoomMessage(const std::string& roomName) {
+    return admitToken(roomMessageBuckets, roomName, ROOM_MESSAGE_RATE_PER_SECOND, ROOM_MESSAGE_BURST);
+}
+
+bool chatRoomExists(const std::string& roomName) {
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    return chatRooms.count(roomName) != 0;
+}
+
+uint32_t firstRetainedSequence(const std::string& roomName) {
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    auto it = chatRooms.find(roomName);
+    return it != chatRooms.end() ? it->second.historyBase + 1 : 1;
+}
+
+// Any JOIN can create a room, so new rooms count against the creator's quota
+// and the room cap.
+bool admitRoomCreation(const std::string& username, std::string& reason) {
+    size_t roomCount;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        roomCount = chatRooms.size();
+    }
+    if (roomCount >= MAX_ROOMS) {
+        reason = "The server cannot take more chat rooms.";
+        return false;
+    }
+    if (!admitToken(roomCreateBuckets, username, ROOM_CREATE_RATE_PER_SECOND, ROOM_CREATE_BURST)) {
+        reason = "You are creating chat rooms too quickly.";
+        return false;
+    }
+    return true;
+}
+
+// A bucket that would have refilled completely carries no state, so it is dropped.
+void pruneIdleBuckets(std::unordered_map<std::string, TokenBucket>& buckets, double ratePerSecond, double burst) {
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = buckets.begin(); it != buckets.end();) {
+        double elapsed = std::chrono::duration<double>(now - it->second.lastRefill).count();
+        if (it->second.tokens + elapsed * ratePerSecond >= burst) {
+            it = buckets.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+int filterCharacterClass(unsigned char c) {
+    if (c >= '0' && c <= '9') {
+        return 1 + (c - '0');
+    }
+    if (std::isalpha(c)) {
+        return 11 + (std::tolower(c) - 'a');
+    }
+    return 0;
+}
+
+std::shared_ptr<const ContentFilter> compileContentFilter(const std::set<std::string>& words) {
+    std::shared_ptr<ContentFilter> filter = std::make_shared<ContentFilter>();
+    std::array<int, FILTER_ALPHABET_SIZE> empty;
+    empty.fill(-1);
+    filter->transitions.push_back(empty);
+    filter->accepting.push_back(false);
+
+    // Build the trie of separator-padded words
+    for (const std::string& word : words) {
+        std::vector<int> classes(1, 0);
+        for (unsigned char c : word) {
+            classes.push_back(filterCharacterClass(c));
+        }
+        classes.push_back(0);
+        int state = 0;
+        for (int characterClass : classes) {
+            if (filter->transitions[state][characterClass] < 0) {
+                filter->transitions[state][characterClass] = static_cast<int>(filter->transitions.size());
+                filter->transitions.push_back(empty);
+                filter->accepting.push_back(false);
+            }
+            state = filter->transitions[state][characterClass];
+        }
+        filter->accepting[state] = true;
+    }
+
+    // Breadth-first pass turning failure links into direct transitions
+    std::vector<int> failure(filter->transitions.size(), 0);
+    std::deque<int> pending;
+    for (int characterClass = 0; characterClass < FILTER_ALPHABET_SIZE; ++characterClass) {
+        int& next = filter->transitions[0][characterClass];
+        if (next < 0) {
+            next = 0;
+        }
+        else {
+            pending.push_back(next);
+        }
+    }
+    while (!pending.empty()) {
+        int state = pending.front();
+        pending.pop_front();
+        if (filter->accepting[failure[state]]) {
+            filter->accepting[state] = true;
+        }
+        for (int characterClass = 0; characterClass < FILTER_ALPHABET_SIZE; ++characterClass) {
+            int& next = filter->transitions[state][characterClass];
+            int fallback = filter->transitions[failure[state]][characterClass];
+            if (next < 0) {
+                next = fallback;
+            }
+            else {
+                failure[next] = fallback;
+                pending.push_back(next);
+            }
+        }
+    }
+    return filter;
+}
+
+bool contentFilterMatches(const ContentFilter& filter, const std::string& text) {
+    int state = filter.transitions[0][0];
+    for (unsigned char c : text) {
+        state = filter.transitions[state][filterCharacterClass(c)];
+        if (filter.accepting[state]) {
+            return true;
+        }
+    }
+    return filter.accepting[filter.transitions[state][0]];
+}
+
+bool updateContentFilter(const std::string& roomName, const std::string& word, bool add) {
+    if (word.empty()) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    auto it = chatRooms.find(roomName);
+    if (it == chatRooms.end()) {
+        return false;
+    }
+    ChatRoom& chatRoom = it->second;
+    if (add) {
+        chatRoom.filterWords.insert(toLowerCase(word));
+    }
+    else {
+        chatRoom.filterWords.erase(toLowerCase(word));
+    }
+    chatRoom.contentFilter = chatRoom.filterWords.empty() ? nullptr : compileContentFilter(chatRoom.filterWords);
+    markRoomForSnapshot(roomName, true);
+    return true;
+}
+
+// Delivers to a locally connected recipient. Returns false if the user is not connected here.
+bool deliverPrivateMessage(const std::string& recipientUsername, const std::string& senderUsername, const std::string& message) {
+    SOCKET recipientSocket;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        auto recipient = usernameSockets.find(recipientUsername);
+        if (recipient == usernameSockets.end()) {
+            return false;
+        }
+        recipientSocket = recipient->second;
+    }
+    std::string privateMsg = "[Private] " + senderUsername + ": " + message + "\n";
+    sendToClient(recipientSocket, privateMsg.c_str(), static_cast<int>(privateMsg.length()));
+    return true;
+}
+
+// Returns the node a user is connected to according to the cluster-wide
+// directory, or an empty string.
+std::string findUserNode(const std::string& username) {
+    if (!clusterEnabled) {
+        return "";
+    }
+    std::lock_guard<std::mutex> lock(clusterMutex);
+    auto entry = userDirectory.find(username);
+    return entry != userDirectory.end() ? entry->second : "";
+}
+
+// Sends a line to a user connected here. Returns false if they are not.
+bool deliverNotice(const std::string& username, const std::string& text) {
+    SOCKET userSocket;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        auto user = usernameSockets.find(username);
+        if (user == usernameSockets.end()) {
+            return false;
+        }
+        userSocket = user->second;
+    }
+    sendToClient(userSocket, text.c_str(), static_cast<int>(text.length()));
+    return true;
+}
+
+// Looks for the recipient locally first, then in the cluster-wide user directory.
+bool sendPrivateMessage(const std::string& recipientUsername, const std::string& message, SOCKET senderSocket) {
+    std::string senderUsername = getUsernameForSocket(senderSocket);
+    if (deliverPrivateMessage(recipientUsername, senderUsername, message)) {
+        return true;
+    }
+    std::string nodeId = findUserNode(recipientUsername);
+    if (nodeId.empty()) {
+        return false;
+    }
+    std::vector<std::string> fields = { recipientUsername, senderUsername, message };
+    queueClusterFrame(nodeId, encodeClusterFrame(ClusterFrameType::PrivateMessage, fields));
+    return true;
+}
+
+// Sends a reply line to a user connected to another node.
+void sendClusterNotice(const std::string& nodeId, const std::string& username, const std::string& text) {
+    std::vector<std::string> fields = { username, text };
+    queueClusterFrame(nodeId, encodeClusterFrame(ClusterFrameType::Notice, fields));
+}
+
+// Sends a line to the user wherever in the cluster they are connected.
+// Returns false if the user is not online.
+bool notifyUser(const std::string& username, const std::string& text) {
+    if (deliverNotice(username, text)) {
+        return true;
+    }
+    std::string nodeId = findUserNode(username);
+    if (nodeId.empty()) {
+        return false;
+    }
+    sendClusterNotice(nodeId, username, text);
+    return true;
+}
+
+const char* presenceStateName(PresenceState state) {
+    switch (state) {
+    case PresenceState::Online: return "online";
+    case PresenceState::Away: return "away";
+    case PresenceState::Typing: return "typing";
+    default: return "offline";
+    }
+}
+
+uint64_t scheduleTimer(int delayMs, std::function<void()> callback);
+
+int millisecondsUntil(std::chrono::steady_clock::duration remaining) {
+    return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(remaining).count()) + 1;
+}
+
+// Callers must hold presenceMutex.
+void queuePresenceFlush(const std::string& roomName) {
+    presenceFlushQueue.push_back(roomName);
+    presenceCV.notify_one();
+}
+
+void presenceFlushDue(const std::string& roomName) {
+    std::lock_guard<std::mutex> lock(presenceMutex);
+    queuePresenceFlush(roomName);
+}
+
+// Callers must hold presenceMutex. The first change after a flush schedules the
+// next one, so a room is flushed at most once per PRESENCE_FLUSH_INTERVAL_MS.
+void markPresenceDirty(RoomPresence& presence, const std::string& roomName, const std::string& username) {
+    presence.pending.insert(username);
+    if (!dirtyPresenceRooms.insert(roomName).second) {
+        return;
+    }
+    auto wait = presence.lastFlush + std::chrono::milliseconds(PRESENCE_FLUSH_INTERVAL_MS) - std::chrono::steady_clock::now();
+    if (wait <= std::chrono::steady_clock::duration::zero()) {
+        queuePresenceFlush(roomName);
+    }
+    else {
+        scheduleTimer(millisecondsUntil(wait), std::bind(presenceFlushDue, roomName));
+    }
+}
+
+// Re-arms itself every PRESENCE_SNAPSHOT_INTERVAL_MS until the room's presence
+// entry is dropped or replaced by a newer one.
+void presenceSnapshotDue(const std::string& roomName, uint64_t generation) {
+    std::lock_guard<std::mutex> lock(presenceMutex);
+    auto it = roomPresence.find(roomName);
+    if (it == roomPresence.end() || it->second.generation != generation) {
+        return;
+    }
+    it->second.snapshotDue = true;
+    queuePresenceFlush(roomName);
+    scheduleTimer(PRESENCE_SNAPSHOT_INTERVAL_MS, std::bind(presenceSnapshotDue, roomName, generation));
+}
+
+// Typing is refreshed without touching the timer; an early expiry re-arms for
+// whatever is left of the deadline.
+void expireUserTyping(const std::string& roomName, const std::string& username) {
+    std::lock_guard<std::mutex> lock(presenceMutex);
+    auto it = roomPresence.find(roomName);
+    if (it == roomPresence.end()) {
+        return;
+    }
+    RoomPresence& presence = it->second;
+    auto deadline = presence.typingDeadlines.find(username);
+    if (deadline == presence.typingDeadlines.end()) {
+        return;
+    }
+    auto remaining = deadline->second - std::chrono::steady_clock::now();
+    if (remaining > std::chrono::steady_clock::duration::zero()) {
+        scheduleTimer(millisecondsUntil(remaining), std::bind(expireUserTyping, roomName, username));
+        return;
+    }
+    presence.typingDeadlines.erase(deadline);
+    auto global = userPresence.find(username);
+    presence.states[username] = global != userPresence.end() ? global->second : PresenceState::Online;
+    markPresenceDirty(presence, roomName, username);
+}
+
+// Callers must hold presenceMutex.
+std::string formatPresenceEntry(const std::string& username, PresenceState state) {
+    std::string entry = "  " + username + ": " + presenceStateName(state);
+    auto status = presenceStatusMessages.find(username);
+    if (status != presenceStatusMessages.end() && !status->second.empty()) {
+        entry += " - " + status->second;
+    }
+    return entry + "\n";
+}
+
+// Callers must hold presenceMutex.
+std::string buildPresenceSnapshot(const std::string& roomName, const RoomPresence& presence) {
+    std::string snapshot = "[Presence snapshot] " + roomName + "\n";
+    for (const auto& entry : presence.states) {
+        if (entry.second != PresenceState::Offline) {
+            snapshot += formatPresenceEntry(entry.first, entry.second);
+        }
+    }
+    return snapshot;
+}
+
+void setRoomPresence(const std::string& roomName, const std::string& username, PresenceState state) {
+    if (username.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(presenceMutex);
+    auto it = roomPresence.find(roomName);
+    if (it == roomPresence.end()) {
+        return;
+    }
+    RoomPresence& presence = it->second;
+    auto current = presence.states.find(username);
+    if (current == presence.states.end() || current->second == state) {
+        return;
+    }
+    current->second = state;
+    if (state != PresenceState::Typing) {
+        presence.typingDeadlines.erase(username);
+    }
+    markPresenceDirty(presence, roomName, username);
+}
+
+void setUserTyping(const std::string& roomName, const std::string& username) {
+    if (username.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(presenceMutex);
+    auto it = roomPresence.find(roomName);
+    if (it == roomPresence.end() || it->second.states.count(username) == 0) {
+        return;
+    }
+    RoomPresence& presence = it->second;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(TYPING_TIMEOUT_MS);
+    auto typing = presence.typingDeadlines.insert(std::make_pair(username, deadline));
+    if (typing.second) {
+        scheduleTimer(TYPING_TIMEOUT_MS, std::bind(expireUserTyping, roomName, username));
+    }
+    else {
+        typing.first->second = deadline;
+    }
+    if (presence.states[username] != PresenceState::Typing) {
+        presence.states[username] = PresenceState::Typing;
+        markPresenceDirty(presence, roomName, username);
+    }
+}
+
+void clearUserTyping(const std::string& roomName, const std::string& username) {
+    PresenceState restored;
+    {
+        std::lock_guard<std::mutex> lock(presenceMutex);
+        auto global = userPresence.find(username);
+        restored = global != userPresence.end() ? global->second : PresenceState::Online;
+    }
+    setRoomPresence(roomName, username, restored);
+}
+
+void setUserPresence(const std::string& username, PresenceState state) {
+    if (username.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(presenceMutex);
+    if (state == PresenceState::Offline) {
+        userPresence.erase(username);
+    }
+    else {
+        userPresence[username] = state;
+    }
+    auto rooms = userPresenceRooms.find(username);
+    if (rooms == userPresenceRooms.end()) {
+        return;
+    }
+    for (const std::string& roomName : rooms->second) {
+        RoomPresence& presence = roomPresence[roomName];
+        presence.states[username] = state;
+        presence.typingDeadlines.erase(username);
+        markPresenceDirty(presence, roomName, username);
+    }
+    if (state == PresenceState::Offline) {
+        userPresenceRooms.erase(rooms);
+    }
+}
+
+void presenceJoinRoom(const std::string& roomName, const std::string& username, SOCKET clientSocket) {
+    if (username.empty()) {
+        return;
+    }
+    std::string snapshot;
+    {
+        std::lock_guard<std::mutex> lock(presenceMutex);
+        auto global = userPresence.find(username);
+        PresenceState state = global != userPresence.end() ? global->second : PresenceState::Online;
+        RoomPresence& presence = roomPresence[roomName];
+        if (presence.generation == 0) {
+            presence.generation = nextPresenceGeneration++;
+            scheduleTimer(PRESENCE_SNAPSHOT_INTERVAL_MS, std::bind(presenceSnapshotDue, roomName, presence.generation));
+        }
+        presence.states[username] = state;
+        userPresenceRooms[username].insert(roomName);
+        markPresenceDirty(presence, roomName, username);
+        snapshot = buildPresenceSnapshot(roomName, presence);
+    }
+    // The joiner gets the full picture immediately; everyone else sees a delta.
+    sendToClient(clientSocket, snapshot.c_str(), static_cast<int>(snapshot.length()));
+}
+
+void presenceLeaveRoom(const std::string& roomName, const std::string& username) {
+    if (username.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(presenceMutex);
+    auto rooms = userPresenceRooms.find(username);
+    if (rooms != userPresenceRooms.end()) {
+        rooms->second.erase(roomName);
+    }
+    auto it = roomPresence.find(roomName);
+    if (it != roomPresence.end() && it->second.states.count(username) != 0) {
+        it->second.states[username] = PresenceState::Offline;
+        it->second.typingDeadlines.erase(username);
+        markPresenceDirty(it->second, roomName, username);
+    }
+}
+
+void markPresenceProfileChanged(const std::string& username, const std::string& statusMessage) {
+    if (username.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(presenceMutex);
+    presenceStatusMessages[username] = statusMessage;
+    auto rooms = userPresenceRooms.find(username);
+    if (rooms == userPresenceRooms.end()) {
+        return;
+    }
+    for (const std::string& roomName : rooms->second) {
+        markPresenceDirty(roomPresence[roomName], roomName, username);
+    }
+}
+
+// Builds the broadcast for a room handed over by the timer wheel: a delta when
+// changes are pending, otherwise the periodic snapshot. Rooms nobody is in any
+// more are dropped. Callers must hold presenceMutex.
+void collectPresenceUpdate(const std::string& roomName, std::vector<std::pair<std::string, std::string>>& outgoing) {
+    dirtyPresenceRooms.erase(roomName);
+    auto it = roomPresence.find(roomName);
+    if (it == roomPresence.end()) {
+        return;
+    }
+    RoomPresence& presence = it->second;
+    if (!presence.pending.empty()) {
+        std::string delta = "[Presence] " + roomName + "\n";
+        for (const std::string& username : presence.pending) {
+            auto state = presence.states.find(username);
+            if (state == presence.states.end()) {
+                continue;
+            }
+            delta += formatPresenceEntry(username, state->second);
+            if (state->second == PresenceState::Offline) {
+                presence.states.erase(state);
+            }
+        }
+        presence.pending.clear();
+        presence.lastFlush = std::chrono::steady_clock::now();
+        presence.snapshotDue = false;
+        outgoing.push_back(std::make_pair(roomName, delta));
+    }
+    else if (presence.snapshotDue) {
+        presence.snapshotDue = false;
+        outgoing.push_back(std::make_pair(roomName, buildPresenceSnapshot(roomName, presence)));
+    }
+    if (presence.states.empty()) {
+        roomPresence.erase(it);
+    }
+}
+
+void presenceFlusher() {
+    std::vector<std::pair<std::string, std::string>> outgoing;
+    std::unique_lock<std::mutex> lock(presenceMutex);
+    while (true) {
+        presenceCV.wait(lock, [] { return !presenceFlushQueue.empty(); });
+        while (!presenceFlushQueue.empty()) {
+            collectPresenceUpdate(presenceFlushQueue.front(), outgoing);
+            presenceFlushQueue.pop_front();
+        }
+        lock.unlock();
+        for (const auto& update : outgoing) {
+            broadcastMessage(update.second, getChatRoomMembers(update.first), INVALID_SOCKET);
+        }
+        outgoing.clear();
+        lock.lock();
+    }
+}
+
+std::vector<std::string> tokenizeSearchText(const std::string& text) {
+    std::vector<std::string> tokens;
+    std::string token;
+    for (size_t i = 0; i <= text.size(); ++i) {
+        unsigned char c = i < text.size() ? static_cast<unsigned char>(text[i]) : ' ';
+        if (std::isalnum(c)) {
+            if (token.size() < SEARCH_MAX_TERM_LENGTH) {
+                token += static_cast<char>(std::tolower(c));
+            }
+        }
+        else if (!token.empty()) {
+            tokens.push_back(token);
+            token.clear();
+        }
+    }
+    return tokens;
+}
+
+std::string encodePostings(const SearchPostings& postings) {
+    std::string encoded;
+    uint32_t previous = 0;
+    for (const auto& posting : postings) {
+        appendVarint(encoded, posting.first - previous);
+        appendVarint(encoded, posting.second);
+        previous = posting.first;
+    }
+    return encoded;
+}
+
+void decodePostings(const std::string& encoded, SearchPostings& postings) {
+    size_t pos = 0;
+    uint32_t sequence = 0;
+    while (pos < encoded.size()) {
+        sequence += readVarint(encoded, pos);
+        uint32_t frequency = readVarint(encoded, pos);
+        postings.push_back(std::make_pair(sequence, frequency));
+    }
+}
+
+std::shared_ptr<RoomSearchIndex> getRoomSearchIndex(const std::string& roomName, bool create) {
+    std::lock_guard<std::mutex> lock(roomSearchIndexesMutex);
+    auto it = roomSearchIndexes.find(roomName);
+    if (it != roomSearchIndexes.end()) {
+        return it->second;
+    }
+    if (!create) {
+        return nullptr;
+    }
+    std::shared_ptr<RoomSearchIndex> index = std::make_shared<RoomSearchIndex>();
+    index->live = std::make_shared<SearchBuffer>();
+    index->live->firstSequence = 0;
+    index->live->messageCount = 0;
+    index->firstSequence = 0;
+    index->messageCount = 0;
+    index->firstRetainedSequence = 0;
+    index->prunePending = false;
+    roomSearchIndexes[roomName] = index;
+    return index;
+}
+
+std::unordered_map<std::string, uint32_t> countSearchTerms(const std::string& text) {
+    std::unordered_map<std::string, uint32_t> frequencies;
+    for (const std::string& token : tokenizeSearchText(text)) {
+        ++frequencies[token];
+    }
+    return frequencies;
+}
+
+// Adds one room message to the live buffer. Callers must hold clientsMutex so that
+// messages are indexed in sequence order; sealing happens on the search worker.
+void indexRoomMessage(const std::string& roomName, uint32_t sequence, const std::unordered_map<std::string, uint32_t>& frequencies) {
+    std::shared_ptr<RoomSearchIndex> index = getRoomSearchIndex(roomName, true);
+    bool scheduleSeal = false;
+    {
+        std::lock_guard<std::mutex> lock(index->mutex);
+        for (const auto& frequency : frequencies) {
+            index->live->terms[frequency.first].push_back(std::make_pair(sequence, frequency.second));
+        }
+        if (index->live->messageCount++ == 0) {
+            index->live->firstSequence = sequence;
+        }
+        if (index->messageCount++ == 0) {
+            index->firstSequence = sequence;
+        }
+        if (index->live->messageCount >= SEARCH_SEGMENT_MESSAGES) {
+            index->frozen.push_back(index->live);
+            index->live = std::make_shared<SearchBuffer>();
+            index->live->firstSequence = 0;
+            index->live->messageCount = 0;
+            scheduleSeal = true;
+        }
+    }
+    if (scheduleSeal) {
+        std::lock_guard<std::mutex> lock(searchWorkMutex);
+        searchWorkQueue.push_back(index);
+        searchWorkCV.notify_one();
+    }
+}
+
+std::shared_ptr<const SearchSegment> sealSearchBuffer(const SearchBuffer& buffer) {
+    std::shared_ptr<SearchSegment> segment = std::make_shared<SearchSegment>();
+    segment->firstSequence = buffer.firstSequence;
+    segment->messageCount = buffer.messageCount;
+    for (const auto& term : buffer.terms) {
+        segment->postings[term.first] = encodePostings(term.second);
+    }
+    return segment;
+}
+
+// Segments hold disjoint, increasing sequence ranges, so merging an older and a
+// newer segment is a per-term concatenation of their posting lists.
+std::shared_ptr<const SearchSegment> mergeSearchSegments(const SearchSegment& older, const SearchSegment& newer) {
+    std::shared_ptr<SearchSegment> merged = std::make_shared<SearchSegment>();
+    merged->firstSequence = older.firstSequence;
+    merged->messageCount = older.messageCount + newer.messageCount;
+    merged->postings = older.postings;
+    for (const auto& term : newer.postings) {
+        auto existing = merged->postings.find(term.first);
+        if (existing == merged->postings.end()) {
+            merged->postings[term.first] = term.second;
+            continue;
+        }
+        SearchPostings postings;
+        decodePostings(existing->second, postings);
+        decodePostings(term.second, postings);
+        existing->second = encodePostings(postings);
+    }
+    return merged;
+}
+
+// Notes that the room's history now starts at 'firstSequence'. Searches skip
+// evicted messages at once; their postings are pruned by the search worker once
+// they make up half of the index, so pruning costs O(1) per evicted message.
+// Callers must hold clientsMutex.
+void evictSearchPostings(const std::string& roomName, uint32_t firstSequence) {
+    std::shared_ptr<RoomSearchIndex> index = getRoomSearchIndex(roomName, false);
+    if (index == nullptr) {
+        return;
+    }
+    bool schedulePrune = false;
+    {
+        std::lock_guard<std::mutex> lock(index->mutex);
+        index->firstRetainedSequence = firstSequence;
+        size_t evicted = firstSequence > index->firstSequence ? firstSequence - index->firstSequence : 0;
+        if (!index->prunePending && index->messageCount > 0 && 2 * evicted >= index->messageCount) {
+            index->prunePending = true;
+            schedulePrune = true;
+        }
+    }
+    if (schedulePrune) {
+        std::lock_guard<std::mutex> lock(searchWorkMutex);
+        searchWorkQueue.push_back(index);
+        searchWorkCV.notify_one();
+    }
+}
+
+// Returns the postings of the buffer's messages from firstSequence on.
+std::shared_ptr<SearchBuffer> trimSearchBuffer(const SearchBuffer& buffer, uint32_t firstSequence) {
+    std::shared_ptr<SearchBuffer> trimmed = std::make_shared<SearchBuffer>();
+    uint32_t skipped = std::min(firstSequence - buffer.firstSequence, static_cast<uint32_t>(buffer.messageCount));
+    trimmed->firstSequence = buffer.firstSequence + skipped;
+    trimmed->messageCount = buffer.messageCount - skipped;
+    for (const auto& term : buffer.terms) {
+        auto kept = std::lower_bound(term.second.begin(), term.second.end(), std::make_pair(firstSequence, 0u));
+        if (kept != term.second.end()) {
+            trimmed->terms[term.first].assign(kept, term.second.end());
+        }
+    }
+    return trimmed;
+}
+
+// Returns the postings of the segment's messages from firstSequence on.
+std::shared_ptr<const SearchSegment> trimSearchSegment(const SearchSegment& segment, uint32_t firstSequence) {
+    std::shared_ptr<SearchSegment> trimmed = std::make_shared<SearchSegment>();
+    uint32_t skipped = std::min(firstSequence - segment.firstSequence, static_cast<uint32_t>(segment.messageCount));
+    trimmed->firstSequence = segment.firstSequence + skipped;
+    trimmed->messageCount = segment.messageCount - skipped;
+    for (const auto& term : segment.postings) {
+        SearchPostings postings;
+        decodePostings(term.second, postings);
+        auto kept = std::lower_bound(postings.begin(), postings.end(), std::make_pair(firstSequence, 0u));
+        if (kept != postings.end()) {
+            trimmed->postings[term.first] = encodePostings(SearchPostings(kept, postings.end()));
+        }
+    }
+    return trimmed;
+}
+
+// Drops the postings of messages evicted from the room's history. Segments
+// wholly before the retained history are dropped and the one straddling it is
+// rebuilt. Runs on the search worker, which alone replaces segments and frozen
+// buffers, so they can be trimmed without the lock.
+void pruneSearchIndex(RoomSearchIndex& index) {
+    uint32_t firstSequence;
+    std::vector<std::shared_ptr<const SearchSegment>> segments;
+    std::deque<std::shared_ptr<const SearchBuffer>> frozen;
+    {
+        std::lock_guard<std::mutex> lock(index.mutex);
+        index.prunePending = false;
+        firstSequence = index.firstRetainedSequence;
+        segments = index.segments;
+        frozen = index.frozen;
+    }
+    std::vector<std::shared_ptr<const SearchSegment>> kept;
+    for (const auto& segment : segments) {
+        if (segment->firstSequence + segment->messageCount <= firstSequence) {
+            continue;
+        }
+        kept.push_back(segment->firstSequence < firstSequence ? trimSearchSegment(*segment, firstSequence) : segment);
+    }
+    for (auto& buffer : frozen) {
+        if (buffer->firstSequence < firstSequence) {
+            buffer = trimSearchBuffer(*buffer, firstSequence);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(index.mutex);
+    index.segments.swap(kept);
+    // Only buffers frozen since the copy was taken can follow the trimmed ones
+    for (size_t i = 0; i < frozen.size(); ++i) {
+        index.frozen[i] = frozen[i];
+    }
+    if (index.live->messageCount > 0 && index.live->firstSequence < firstSequence) {
+        index.live = trimSearchBuffer(*index.live, firstSequence);
+    }
+    if (firstSequence > index.firstSequence) {
+        uint32_t evicted = std::min(firstSequence - index.firstSequence, static_cast<uint32_t>(index.messageCount));
+        index.firstSequence += evicted;
+        index.messageCount -= evicted;
+    }
+}
+
+// Runs the expensive part of indexing off the send path. Only this thread
+// replaces entries in 'segments', so a merge can be built without the lock and
+// swapped in afterwards.
+void searchIndexWorker() {
+    while (true) {
+        std::shared_ptr<RoomSearchIndex> index;
+        {
+            std::unique_lock<std::mutex> lock(searchWorkMutex);
+            searchWorkCV.wait(lock, [] { return !searchWorkQueue.empty(); });
+            index = searchWorkQueue.front();
+            searchWorkQueue.pop_front();
+        }
+
+        bool prune;
+        {
+            std::lock_guard<std::mutex> lock(index->mutex);
+            prune = index->prunePending;
+        }
+        if (prune) {
+            pruneSearchIndex(*index);
+        }
+
+        std::shared_ptr<const SearchBuffer> buffer;
+        {
+            std::lock_guard<std::mutex> lock(index->mutex);
+            if (index->frozen.empty()) {
+                continue;
+            }
+            buffer = index->frozen.front();
+        }
+        std::shared_ptr<const SearchSegment> sealed = sealSearchBuffer(*buffer);
+        {
+            std::lock_guard<std::mutex> lock(index->mutex);
+            index->segments.push_back(sealed);
+            index->frozen.pop_front();
+        }
+
+        // Merge the two newest segments while they are of similar size, which keeps
+        // the segment count logarithmic in the number of messages
+        while (true) {
+            std::shared_ptr<const SearchSegment> older;
+            std::shared_ptr<const SearchSegment> newer;
+            {
+                std::lock_guard<std::mutex> lock(index->mutex);
+                size_t count = index->segments.size();
+                if (count < 2 || index->segments[count - 2]->messageCount > 2 * index->segments[count - 1]->messageCount) {
+                    break;
+                }
+                older = index->segments[count - 2];
+                newer = index->segments[count - 1];
+            }
+            std::shared_ptr<const SearchSegment> merged = mergeSearchSegments(*older, *newer);
+            {
+                std::lock_guard<std::mutex> lock(index->mutex);
+                index->segments.pop_back();
+                index->segments.back() = merged;
+            }
+        }
+    }
+}
+
+// Returns up to SEARCH_RESULT_LIMIT sequence numbers from firstSequence on of
+// messages containing every query term, best first. Scores are the sum of
+// tf * idf over the query terms, with newer messages winning ties.
+std::vector<uint32_t> searchRoomHistory(const std::string& roomName, const std::string& query, uint32_t firstSequence) {
+    std::vector<uint32_t> results;
+    std::vector<std::string> terms = tokenizeSearchText(query);
+    std::shared_ptr<RoomSearchIndex> index = getRoomSearchIndex(roomName, false);
+    if (terms.empty() || index == nullptr) {
+        return results;
+    }
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+
+    // Segments are immutable, so only the list itself and the live buffer are read under the lock
+    std::vector<SearchPostings> termPostings(terms.size());
+    std::vector<std::shared_ptr<const SearchSegment>> segments;
+    std::vector<std::shared_ptr<const SearchBuffer>> buffers;
+    size_t messageCount;
+    {
+        std::lock_guard<std::mutex> lock(index->mutex);
+        segments = index->segments;
+        buffers.assign(index->frozen.begin(), index->frozen.end());
+        messageCount = index->messageCount;
+        for (size_t t = 0; t < terms.size(); ++t) {
+            auto live = index->live->terms.find(terms[t]);
+            if (live != index->live->terms.end()) {
+                termPostings[t] = live->second;
+            }
+        }
+    }
+    for (size_t t = 0; t < terms.size(); ++t) {
+        SearchPostings older;
+        for (const auto& segment : segments) {
+            auto postings = segment->postings.find(terms[t]);
+            if (postings != segment->postings.end()) {
+                decodePostings(postings->second, older);
+            }
+        }
+        for (const auto& buffer : buffers) {
+            auto postings = buffer->terms.find(terms[t]);
+            if (postings != buffer->terms.end()) {
+                older.insert(older.end(), postings->second.begin(), postings->second.end());
+            }
+        }
+        termPostings[t].insert(termPostings[t].begin(), older.begin(), older.end());
+        if (termPostings[t].empty()) {
+            return results;
+        }
+    }
+
+    // Walk the shortest posting list and probe the others, all sorted by sequence
+    std::vector<size_t> order(terms.size());
+    for (size_t t = 0; t < order.size(); ++t) {
+        order[t] = t;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return termPostings[a].size() < termPostings[b].size(); });
+    std::vector<std::pair<double, uint32_t>> scored;
+    for (const auto& candidate : termPostings[order[0]]) {
+        if (candidate.first < firstSequence) {
+            continue;
+        }
+        double score = 0.0;
+        bool matchesAll = true;
+        for (size_t t : order) {
+            const SearchPostings& postings = termPostings[t];
+            auto hit = std::lower_bound(postings.begin(), postings.end(), std::make_pair(candidate.first, 0u));
+            if (hit == postings.end() || hit->first != candidate.first) {
+                matchesAll = false;
+                break;
+            }
+            double idf = std::log(1.0 + static_cast<double>(messageCount) / postings.size());
+            score += hit->second * idf;
+        }
+        if (matchesAll) {
+            scored.push_back(std::make_pair(score, candidate.first));
+        }
+    }
+
+    size_t limit = std::min(SEARCH_RESULT_LIMIT, scored.size());
+    std::partial_sort(scored.begin(), scored.begin() + limit, scored.end(), [](const std::pair<double, uint32_t>& a, const std::pair<double, uint32_t>& b) {
+        return a.first != b.first ? a.first > b.first : a.second > b.second;
+    });
+    for (size_t i = 0; i < limit; ++i) {
+        results.push_back(scored[i].second);
+    }
+    return results;
+}
+
+// Room messages carry the room's sequence number, which is their 1-based
+// position in the room's history.
+std::string formatRoomMessage(const std::string& roomName, uint32_t sequence, const std::string& roomMessage) {
+    return "[" + roomName + " #" + std::to_string(sequence) + "] " + roomMessage + "\n";
+}
+
+// Strips the "[room #sequence] " prefix and trailing newline from a history entry.
+std::string roomMessageText(const std::string& entry) {
+    size_t prefixEnd = entry.find("] ");
+    std::string text = prefixEnd == std::string::npos ? entry : entry.substr(prefixEnd + 2);
+    if (!text.empty() && text.back() == '\n') {
+        text.pop_back();
+    }
+    return text;
+}
+
+bool parseSequenceNumber(const std::string& text, uint32_t& sequence) {
+    if (text.empty() || text.size() > 10 || text.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    unsigned long long value = std::strtoull(text.c_str(), nullptr, 10);
+    if (value > UINT32_MAX) {
+        return false;
+    }
+    sequence = static_cast<uint32_t>(value);
+    return true;
+}
+
+// Advances the user's read cursor for the room to 'sequence'. Acknowledgements
+// are cumulative, so a late or repeated ACK never moves the cursor back.
+void acknowledgeRoomMessages(const std::string& username, const std::string& roomName, uint32_t sequence) {
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    auto cursors = readCursors.find(username);
+    if (cursors == readCursors.end()) {
+        return;
+    }
+    auto cursor = cursors->second.find(roomName);
+    if (cursor == cursors->second.end()) {
+        return;
+    }
+    if (isRoomOwnedLocally(roomName)) {
+        auto it = chatRooms.find(roomName);
+        sequence = std::min(sequence, it != chatRooms.end() ? lastRoomSequence(it->second) : 0u);
+    }
+    if (sequence > cursor->second) {
+        cursor->second = sequence;
+        markUserForSnapshot(username);
+    }
+}
+
+// Resends the room's messages numbered first..last, at most GAP_FILL_LIMIT of
+// them, after a header naming the range actually sent so the client can ask
+// for the remainder.
+// Resends messages first..last to a member of a room this node owns.
+void sendRoomHistoryRange(SOCKET clientSocket, const std::string& roomName, uint32_t first, uint32_t last) {
+    std::string response;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        const ChatRoom* chatRoom = findMemberChatRoom(roomName, clientSocket);
+        if (chatRoom == nullptr) {
+            response = "You are not a member of the chat room: " + roomName + "\n";
+        }
+        else if (!isRoomOwnedLocally(roomName)) {
+            response = "The history of chat room " + roomName + " is kept on node " + roomOwnerNode(roomName) + ".\n";
+        }
+        else {
+            first = std::max(first, chatRoom->historyBase + 1);
+            last = std::min(last, lastRoomSequence(*chatRoom));
+            if (first > last) {
+                response = "[Gap] " + roomName + " has no messages in that range\n";
+            }
+            else {
+                last = std::min(last, first + GAP_FILL_LIMIT - 1);
+                response = "[Gap] " + roomName + " #" + std::to_string(first) + "-#" + std::to_string(last) + "\n";
+                for (uint32_t sequence = first; sequence <= last; ++sequence) {
+                    response += *findRoomMessage(*chatRoom, sequence);
+                }
+            }
+        }
+    }
+    sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+}
+
+// Appends a message to a room this node owns, delivers it to local members and
+// forwards it to every node subscribed to the room.
+// Returns false if the sender is banned from the room.
+bool publishRoomMessage(const std::string& roomName, const std::string& senderUsername, const std::string& roomMessage) {
+    std::unordered_map<std::string, uint32_t> searchTerms = countSearchTerms(roomMessage);
+    std::string fullMessage;
+    ChatRoom* room;
+    bool drainDeliveries = false;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        ChatRoom& chatRoom = chatRooms[roomName];
+        chatRoom.name = roomName;
+        room = &chatRoom;
+        if (chatRoom.bannedUsers.count(senderUsername) != 0) {
+            return false;
+        }
+        uint32_t sequence = lastRoomSequence(chatRoom) + 1;
+        fullMessage = formatRoomMessage(roomName, sequence, roomMessage);
+        HistoryEntry entry = std::make_shared<const std::string>(fullMessage);
+        // A room that has just grown large keeps queueing directly until the
+        // earlier direct deliveries are out, so nobody sees messages reordered
+        if (chatRoom.largeRoom && !chatRoom.delivering) {
+            fanoutRoomMessage(chatRoom, fullMessage);
+        }
+        else {
+            drainDeliveries = queueRoomDelivery(chatRoom, entry);
+        }
+        retainRoomMessage(chatRoom, entry, searchTerms);
+        evictRoomHistory();
+        markRoomForSnapshot(roomName, false);
+        indexRoomMessage(roomName, sequence, searchTerms);
+        indexRoomActivity(roomName);
+
+        // The sender has seen their own message; only a caught-up cursor can skip past it
+        auto cursors = readCursors.find(senderUsername);
+        if (cursors != readCursors.end()) {
+            auto cursor = cursors->second.find(roomName);
+            if (cursor != cursors->second.end() && cursor->second + 1 == sequence) {
+                cursor->second = sequence;
+                markUserForSnapshot(senderUsername);
+            }
+        }
+    }
+    if (drainDeliveries) {
+        drainRoomDeliveries(*room);
+    }
+    if (clusterEnabled) {
+        std::vector<std::string> subscribers;
+        {
+            std::lock_guard<std::mutex> lock(clusterMutex);
+            auto it = roomSubscribers.find(roomName);
+            if (it != roomSubscribers.end()) {
+                subscribers.assign(it->second.begin(), it->second.end());
+            }
+        }
+        if (!subscribers.empty()) {
+            std::vector<std::string> fields = { roomName, fullMessage };
+            std::string frame = encodeClusterFrame(ClusterFrameType::Deliver, fields);
+            for (const std::string& nodeId : subscribers) {
+                queueClusterFrame(nodeId, frame);
+            }
+        }
+    }
+    return true;
+}
+
+// Delivers a message sequenced by the owning node to this node's members of the room.
+void deliverRemoteRoomMessage(const std::string& roomName, const std::string& fullMessage) {
+    ChatRoom* room = nullptr;
+    bool drainDeliveries = false;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        auto it = chatRooms.find(roomName);
+        if (it != chatRooms.end()) {
+            room = &it->second;
+            if (it->second.largeRoom && !it->second.delivering) {
+                fanoutRoomMessage(it->second, fullMessage);
+            }
+            else {
+                drainDeliveries = queueRoomDelivery(it->second, std::make_shared<const std::string>(fullMessage));
+            }
+        }
+    }
+    if (drainDeliveries) {
+        drainRoomDeliveries(*room);
+    }
+    indexRoomActivity(roomName);
+}
+
+// Takes a user connected to this node out of the room and tells them why.
+// 'connected' reports whether the user is connected here at all. Returns true
+// if they were a member.
+bool removeLocalRoomMember(const std::string& roomName, const std::string& targetUsername, bool ban, bool& connected) {
+    SOCKET targetSocket;
+    bool wasMember = false;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        auto target = usernameSockets.find(targetUsername);
+        connected = target != usernameSockets.end();
+        if (!connected) {
+            return false;
+        }
+        targetSocket = target->second;
+        auto it = chatRooms.find(roomName);
+        if (it != chatRooms.end()) {
+            wasMember = it->second.members.erase(targetSocket) != 0;
+            if (wasMember) {
+                fanoutMembershipChanged(it->second, targetSocket, false);
+                indexRoomMemberCount(roomName, it->second.members.size());
+                updateRoomSubscription(roomName, it->second.members.size());
+            }
+        }
+        socketRooms[targetSocket].erase(roomName);
+        readCursors[targetUsername].erase(roomName);
+        markUserForSnapshot(targetUsername);
+        markRoomForSnapshot(roomName, true);
+    }
+    if (wasMember) {
+        presenceLeaveRoom(roomName, targetUsername);
+    }
+    std::string notice = (ban ? "You have been banned from the chat room: " : "You have been kicked from the chat room: ") + roomName + "\n";
+    sendToClient(targetSocket, notice.c_str(), static_cast<int>(notice.length()));
+    return wasMember;
+}
+
+// Removes the target from a room this node owns. Moderators can only act on users
+// ranked below them. With 'ban' set the user is also barred from rejoining.
+bool removeUserFromChatRoom(const std::string& roomName, const std::string& moderatorUsername, const std::string& targetUsername, bool ban) {
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        auto it = chatRooms.find(roomName);
+        if (it == chatRooms.end() || targetUsername.empty()) {
+            return false;
+        }
+        ChatRoom& chatRoom = it->second;
+        if (getRoomRole(chatRoom, moderatorUsername) <= getRoomRole(chatRoom, targetUsername)) {
+            return false;
+        }
+        if (ban) {
+            chatRoom.bannedUsers.insert(targetUsername);
+            chatRoom.roles.erase(targetUsername);
+            markRoomForSnapshot(roomName, true);
+        }
+    }
+    bool connected;
+    bool wasMember = removeLocalRoomMember(roomName, targetUsername, ban, connected);
+    std::string nodeId = connected ? "" : findUserNode(targetUsername);
+    if (!nodeId.empty()) {
+        // The owner does not track other nodes' members, so a user connected
+        // elsewhere is removed by their node and the kick counts as done
+        std::vector<std::string> fields = { roomName, targetUsername, ban ? "1" : "0" };
+        queueClusterFrame(nodeId, encodeClusterFrame(ClusterFrameType::RemoveMember, fields));
+        wasMember = true;
+    }
+    return ban || wasMember;
+}
+
+bool kickUserFromChatRoom(const std::string& roomName, const std::string& moderatorUsername, const std::string& targetUsername) {
+    return removeUserFromChatRoom(roomName, moderatorUsername, targetUsername, false);
+}
+
+bool banUserFromChatRoom(const std::string& roomName, const std::string& moderatorUsername, const std::string& targetUsername) {
+    return removeUserFromChatRoom(roomName, moderatorUsername, targetUsername, true);
+}
+
+bool unbanUserFromChatRoom(const std::string& roomName, const std::string& targetUsername) {
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    auto it = chatRooms.find(roomName);
+    if (it == chatRooms.end() || it->second.bannedUsers.erase(targetUsername) == 0) {
+        return false;
+    }
+    markRoomForSnapshot(roomName, true);
+    return true;
+}
+
+// Only the room owner hands out or takes away moderator rights.
+bool setModeratorRights(const std::string& roomName, const std::string& ownerUsername, const std::string& targetUsername, bool grant) {
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        auto it = chatRooms.find(roomName);
+        if (it == chatRooms.end() || targetUsername.empty() || targetUsername == ownerUsername) {
+            return false;
+        }
+        ChatRoom& chatRoom = it->second;
+        if (getRoomRole(chatRoom, ownerUsername) != RoomRole::Owner || chatRoom.bannedUsers.count(targetUsername) != 0) {
+            return false;
+        }
+        if (grant) {
+            chatRoom.roles[targetUsername] = RoomRole::Moderator;
+        }
+        else {
+            chatRoom.roles.erase(targetUsername);
+        }
+        markRoomForSnapshot(roomName, true);
+    }
+    notifyUser(targetUsername, (grant ? "You have been granted moderator rights in the chat room: " : "Your moderator rights have been revoked in the chat room: ") + roomName + "\n");
+    return true;
+}
+
+bool grantModeratorRights(const std::string& roomName, const std::string& ownerUsername, const std::string& targetUsername) {
+    return setModeratorRights(roomName, ownerUsername, targetUsername, true);
+}
+
+bool revokeModeratorRights(const std::string& roomName, const std::string& ownerUsername, const std::string& targetUsername) {
+    return setModeratorRights(roomName, ownerUsername, targetUsername, false);
+}
+
+bool isModerationCommand(const std::string& command) {
+    return command == "KICK_USER" || command == "BAN_USER" || command == "UNBAN_USER" || command == "GRANT_MODERATOR" ||
+        command == "REVOKE_MODERATOR" || command == "FILTER_ADD" || command == "FILTER_REMOVE";
+}
+
+// Runs a moderation command against a room this node owns on behalf of
+// 'moderatorUsername', who may be connected to any node, and returns the reply.
+std::string moderateChatRoom(const std::string& command, const std::string& roomName, const std::string& moderatorUsername, const std::string& argument) {
+    bool moderator = isUserModerator(roomName, moderatorUsername);
+    if (command == "KICK_USER") {
+        if (!moderator) {
+            return "You do not have sufficient privileges to kick users from chat room: " + roomName + "\n";
+        }
+        bool applied = kickUserFromChatRoom(roomName, moderatorUsername, argument);
+        return applied ? "Kicked " + argument + " from chat room: " + roomName + "\n" : "Unable to kick " + argument + " from chat room: " + roomName + "\n";
+    }
+    else if (command == "BAN_USER") {
+        if (!moderator) {
+            return "You do not have sufficient privileges to ban users from chat room: " + roomName + "\n";
+        }
+        bool applied = banUserFromChatRoom(roomName, moderatorUsername, argument);
+        return applied ? "Banned " + argument + " from chat room: " + roomName + "\n" : "Unable to ban " + argument + " from chat room: " + roomName + "\n";
+    }
+    else if (command == "UNBAN_USER") {
+        if (!moderator) {
+            return "You do not have sufficient privileges to unban users in chat room: " + roomName + "\n";
+        }
+        bool applied = unbanUserFromChatRoom(roomName, argument);
+        return applied ? "Unbanned " + argument + " in chat room: " + roomName + "\n" : argument + " is not banned from chat room: " + roomName + "\n";
+    }
+    else if (command == "GRANT_MODERATOR") {
+        if (!moderator) {
+            return "You do not have sufficient privileges to grant moderator rights in chat room: " + roomName + "\n";
+        }
+        bool applied = grantModeratorRights(roomName, moderatorUsername, argument);
+        return applied ? "Granted moderator rights to " + argument + " in chat room: " + roomName + "\n" : "Only the owner of chat room " + roomName + " can grant moderator rights to " + argument + "\n";
+    }
+    else if (command == "REVOKE_MODERATOR") {
+        if (!moderator) {
+            return "You do not have sufficient privileges to revoke moderator rights in chat room: " + roomName + "\n";
+        }
+        bool applied = revokeModeratorRights(roomName, moderatorUsername, argument);
+        return applied ? "Revoked moderator rights of " + argument + " in chat room: " + roomName + "\n" : "Only the owner of chat room " + roomName + " can revoke moderator rights of " + argument + "\n";
+    }
+    else {
+        bool add = command == "FILTER_ADD";
+        if (!moderator) {
+            return "You do not have sufficient privileges to change the content filter of chat room: " + roomName + "\n";
+        }
+        if (!updateContentFilter(roomName, argument, add)) {
+            return "Invalid filter word.\n";
+        }
+        return add ? "Added '" + argument + "' to the content filter of chat room: " + roomName + "\n" : "Removed '" + argument + "' from the content filter of chat room: " + roomName + "\n";
+    }
+}
+
+void sendUserProfile(const std::string& username, SOCKET clientSocket) {
+    for (const auto& client : clients) {
+        if (client.username == username) {
+            std::string profile = "[Profile]\n";
+            profile += "Username: " + client.username + "\n";
+            profile += "Profile Picture: " + client.profilePicture + "\n";
+            profile += "Status Message: " + client.statusMessage + "\n";
+            sendToClient(clientSocket, profile.c_str(), static_cast<int>(profile.length()));
+            return;
+        }
+    }
+}
+
+void updateUserProfile(const std::string& username, const std::string& profilePicture, const std::string& statusMessage) {
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        for (auto& client : clients) {
+            if (client.username == username) {
+                client.profilePicture = profilePicture;
+                client.statusMessage = statusMessage;
+                break;
+            }
+        }
+        if (!username.empty()) {
+            savedProfiles[username] = UserProfile{ profilePicture, statusMessage };
+            markUserForSnapshot(username);
+        }
+    }
+    markPresenceProfileChanged(username, statusMessage);
+}
+
+// Counts, per room the connection is in, the messages past the user's read
+// cursor. Rooms owned by another cluster node keep their history there.
+std::vector<std::pair<std::string, uint32_t>> getUnreadRooms(SOCKET clientSocket, const std::string& username) {
+    std::vector<std::pair<std::string, uint32_t>> unreadRooms;
+    auto joined = socketRooms.find(clientSocket);
+    auto cursors = readCursors.find(username);
+    if (joined == socketRooms.end() || cursors == readCursors.end()) {
+        return unreadRooms;
+    }
+    for (const std::string& roomName : joined->second) {
+        auto cursor = cursors->second.find(roomName);
+        if (cursor == cursors->second.end() || !isRoomOwnedLocally(roomName)) {
+            continue;
+        }
+        if (lastRoomSequence(chatRooms[roomName]) > cursor->second) {
+            unreadRooms.push_back(std::make_pair(roomName, cursor->second));
+        }
+    }
+    return unreadRooms;
+}
+
+void sendUnreadMessageNotification(SOCKET clientSocket) {
+    std::string notification = "You have unread messages in the chat rooms:\n";
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        auto session = socketUsernames.find(clientSocket);
+        if (session == socketUsernames.end()) {
+            return;
+        }
+        std::vector<std::pair<std::string, uint32_t>> unreadRooms = getUnreadRooms(clientSocket, session->second);
+        if (unreadRooms.empty()) {
+            return;
+        }
+        for (const auto& room : unreadRooms) {
+            uint32_t unread = lastRoomSequence(chatRooms[room.first]) - room.second;
+            notification += "  - " + room.first + ": " + std::to_string(unread) + " unread\n";
+        }
+    }
+    notification.pop_back();
+    sendNotificationToClient(notification, clientSocket);
+}
+
+// Replays only what the user has not acknowledged. Long backlogs are cut to the
+// latest UNREAD_REPLAY_LIMIT messages; older ones can be fetched with GAP unless
+// they were already evicted.
+void sendUnreadMessages(SOCKET clientSocket) {
+    std::string unreadMessages;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        auto session = socketUsernames.find(clientSocket);
+        if (session == socketUsernames.end()) {
+            return;
+        }
+        for (const auto& room : getUnreadRooms(clientSocket, session->second)) {
+            const ChatRoom& chatRoom = chatRooms[room.first];
+            uint32_t first = std::max(room.second + 1, chatRoom.historyBase + 1);
+            uint32_t last = lastRoomSequence(chatRoom);
+            if (last + 1 - first > UNREAD_REPLAY_LIMIT) {
+                first = last - UNREAD_REPLAY_LIMIT + 1;
+            }
+            if (first > room.second + 1) {
+                unreadMessages += "[Gap] " + room.first + " #" + std::to_string(room.second + 1) + "-#" + std::to_string(first - 1) + " not replayed\n";
+            }
+            for (uint32_t sequence = first; sequence <= last; ++sequence) {
+                unreadMessages += *findRoomMessage(chatRoom, sequence);
+            }
+        }
+    }
+    if (!unreadMessages.empty()) {
+        sendToClient(clientSocket, unreadMessages.c_str(), static_cast<int>(unreadMessages.length()));
+    }
+}
+
+bool createUser(const std::string& username, const std::string& password) {
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    if (userCredentials.count(username) == 0) {
+        userCredentials[username] = password;
+        if (replayMode) {
+            return true;
+        }
+        std::ofstream userDB(USER_DATABASE_FILE, std::ios::app);
+        if (userDB.is_open()) {
+            userDB << username << ":" << password << "\n";
+            userDB.close();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool loadUserCredentials() {
+    std::ifstream userDB(USER_DATABASE_FILE);
+    if (userDB.is_open()) {
+        std::string line;
+        while (std::getline(userDB, line)) {
+            size_t separatorPos = line.find(':');
+            if (separatorPos != std::string::npos) {
+                std::string username = line.substr(0, separatorPos);
+                std::string password = line.substr(separatorPos + 1);
+                userCredentials[username] = password;
+            }
+        }
+        userDB.close();
+        return true;
+    }
+    return false;
+}
+
+bool saveFile(const std::string& fileName, const std::string& data) {
+    if (replayMode) {
+        return true;
+    }
+    std::ofstream file(FILE_STORAGE_DIRECTORY + fileName, std::ios::binary);
+    if (file.is_open()) {
+        file << data;
+        file.close();
+        return true;
+    }
+    return false;
+}
+
+std::string readFile(const std::string& fileName) {
+    if (replayMode) {
+        return "";
+    }
+    std::ifstream file(FILE_STORAGE_DIRECTORY + fileName, std::ios::binary);
+    if (file.is_open()) {
+        std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        file.close();
+        return content;
+    }
+    return "";
+}
+
+// State snapshots. The snapshot thread keeps its own copy of every room and only
+// copies what changed under clientsMutex: room metadata is small and copied in
+// full, while history only grows at the back and is evicted from the front, so
+// just the new tail is copied and the evicted head is dropped. Encoding and
+// writing the file happen without any lock held.
+struct RoomSnapshot {
+    std::unordered_map<std::string, RoomRole> roles;
+    std::unordered_set<std::string> bannedUsers;
+    std::set<std::string> filterWords;
+    std::vector<std::string> memberUsernames;
+    std::deque<HistoryEntry> messageHistory;
+    uint32_t historyBase = 0;
+};
+
+// The snapshot writer keeps one ServerSnapshot and only refreshes the rooms and
+// users marked since the previous capture. Users waiting to be put back into
+// their rooms are kept apart and merged into the room member lists on encoding.
+struct ServerSnapshot {
+    std::map<std::string, RoomSnapshot> rooms;
+    std::map<std::string, UserProfile> profiles;
+    std::map<std::string, std::map<std::string, uint32_t>> readCursors;
+    std::map<std::string, std::vector<std::string>> restoredMemberships;
+};
+
+ServerSnapshot snapshotState; // Guarded by snapshotMutex
+
+uint32_t snapshotChecksum(const std::string& data, size_t length) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+    }
+    return hash;
+}
+
+// Copies what changed since the last capture, so the time spent holding
+// clientsMutex follows the amount of change rather than the size of the server.
+void captureServerState(ServerSnapshot& snapshot) {
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    for (const auto& dirty : snapshotDirtyRooms) {
+        auto it = chatRooms.find(dirty.first);
+        if (it == chatRooms.end()) {
+            snapshot.rooms.erase(dirty.first);
+            continue;
+        }
+        const ChatRoom& chatRoom = it->second;
+        RoomSnapshot& room = snapshot.rooms[dirty.first];
+        if (dirty.second) {
+            room.roles = chatRoom.roles;
+            room.bannedUsers = chatRoom.bannedUsers;
+            room.filterWords = chatRoom.filterWords;
+            room.memberUsernames.clear();
+            for (SOCKET member : chatRoom.members) {
+                auto username = socketUsernames.find(member);
+                if (username != socketUsernames.end()) {
+                    room.memberUsernames.push_back(username->second);
+                }
+            }
+        }
+        uint32_t copied = std::max(room.historyBase + static_cast<uint32_t>(room.messageHistory.size()), chatRoom.historyBase);
+        uint32_t evicted = std::min(chatRoom.historyBase - room.historyBase, static_cast<uint32_t>(room.messageHistory.size()));
+        room.messageHistory.erase(room.messageHistory.begin(), room.messageHistory.begin() + evicted);
+        room.historyBase = chatRoom.historyBase;
+        room.messageHistory.insert(room.messageHistory.end(), chatRoom.messageHistory.begin() + (copied - chatRoom.historyBase), chatRoom.messageHistory.end());
+    }
+    snapshotDirtyRooms.clear();
+
+    for (const std::string& username : snapshotDirtyUsers) {
+        auto profile = savedProfiles.find(username);
+        if (profile != savedProfiles.end()) {
+            snapshot.profiles[username] = profile->second;
+        }
+        else {
+            snapshot.profiles.erase(username);
+        }
+        auto cursors = readCursors.find(username);
+        if (cursors != readCursors.end() && !cursors->second.empty()) {
+            snapshot.readCursors[username] = std::map<std::string, uint32_t>(cursors->second.begin(), cursors->second.end());
+        }
+        else {
+            snapshot.readCursors.erase(username);
+        }
+        auto membership = restoredMemberships.find(username);
+        if (membership != restoredMemberships.end() && !membership->second.empty()) {
+            snapshot.restoredMemberships[username] = membership->second;
+        }
+        else {
+            snapshot.restoredMemberships.erase(username);
+        }
+    }
+    snapshotDirtyUsers.clear();
+}
+
+std::string encodeServerSnapshot(const ServerSnapshot& snapshot) {
+    // Users restored from the previous snapshot who have not reconnected yet keep their rooms
+    std::unordered_map<std::string, std::vector<std::string>> restoredMembers;
+    for (const auto& membership : snapshot.restoredMemberships) {
+        for (const std::string& roomName : membership.second) {
+            restoredMembers[roomName].push_back(membership.first);
+        }
+    }
+
+    std::string out = "CRSS";
+    appendVarint(out, SNAPSHOT_FORMAT_VERSION);
+    appendVarint(out, static_cast<uint32_t>(snapshot.rooms.size()));
+    for (const auto& entry : snapshot.rooms) {
+        const RoomSnapshot& room = entry.second;
+        appendEncodedString(out, entry.first);
+        appendVarint(out, static_cast<uint32_t>(room.roles.size()));
+        for (const auto& role : room.roles) {
+            appendEncodedString(out, role.first);
+            appendVarint(out, static_cast<uint32_t>(role.second));
+        }
+        appendVarint(out, static_cast<uint32_t>(room.bannedUsers.size()));
+        for (const std::string& username : room.bannedUsers) {
+            appendEncodedString(out, username);
+        }
+        appendVarint(out, static_cast<uint32_t>(room.filterWords.size()));
+        for (const std::string& word : room.filterWords) {
+            appendEncodedString(out, word);
+        }
+        const std::vector<std::string>& restored = restoredMembers[entry.first];
+        appendVarint(out, static_cast<uint32_t>(room.memberUsernames.size() + restored.size()));
+        for (const std::string& username : room.memberUsernames) {
+            appendEncodedString(out, username);
+        }
+        for (const std::string& username : restored) {
+            appendEncodedString(out, username);
+        }
+        appendVarint(out, room.historyBase);
+        appendVarint(out, static_cast<uint32_t>(room.messageHistory.size()));
+        for (const HistoryEntry& message : room.messageHistory) {
+            appendEncodedString(out, *message);
+        }
+    }
+    appendVarint(out, static_cast<uint32_t>(snapshot.profiles.size()));
+    for (const auto& profile : snapshot.profiles) {
+        appendEncodedString(out, profile.first);
+        appendEncodedString(out, profile.second.profilePicture);
+        appendEncodedString(out, profile.second.statusMessage);
+    }
+    appendVarint(out, static_cast<uint32_t>(snapshot.readCursors.size()));
+    for (const auto& cursors : snapshot.readCursors) {
+        appendEncodedString(out, cursors.first);
+        appendVarint(out, static_cast<uint32_t>(cursors.second.size()));
+        for (const auto& cursor : cursors.second) {
+            appendEncodedString(out, cursor.first);
+            appendVarint(out, cursor.second);
+        }
+    }
+    uint32_t checksum = snapshotChecksum(out, out.size());
+    for (int shift = 0; shift < 32; shift += 8) {
+        out += static_cast<char>((checksum >> shift) & 0xFF);
+    }
+    return out;
+}
+
+bool decodeServerSnapshot(const std::string& in, ServerSnapshot& snapshot) {
+    if (in.size() < 8 || in.compare(0, 4, "CRSS") != 0) {
+        return false;
+    }
+    uint32_t storedChecksum = 0;
+    for (int i = 0; i < 4; ++i) {
+        storedChecksum |= static_cast<uint32_t>(static_cast<unsigned char>(in[in.size() - 4 + i])) << (8 * i);
+    }
+    if (storedChecksum != snapshotChecksum(in, in.size() - 4)) {
+        return false;
+    }
+    std::string body = in.substr(0, in.size() - 4);
+    size_t pos = 4;
+    uint32_t version, roomCount, count, value;
+    if (!readEncodedCount(body, pos, version) || version == 0 || version > SNAPSHOT_FORMAT_VERSION || !readEncodedCount(body, pos, roomCount)) {
+        return false;
+    }
+    for (uint32_t r = 0; r < roomCount; ++r) {
+        std::string roomName, text;
+        if (!readEncodedString(body, pos, roomName)) {
+            return false;
+        }
+        RoomSnapshot& room = snapshot.rooms[roomName];
+        if (!readEncodedCount(body, pos, count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!readEncodedString(body, pos, text) || !readEncodedCount(body, pos, value) || value > static_cast<uint32_t>(RoomRole::Owner)) {
+                return false;
+            }
+            room.roles[text] = static_cast<RoomRole>(value);
+        }
+        if (!readEncodedCount(body, pos, count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!readEncodedString(body, pos, text)) {
+                return false;
+            }
+            room.bannedUsers.insert(text);
+        }
+        if (!readEncodedCount(body, pos, count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!readEncodedString(body, pos, text)) {
+                return false;
+            }
+            room.filterWords.insert(text);
+        }
+        if (!readEncodedCount(body, pos, count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!readEncodedString(body, pos, text)) {
+                return false;
+            }
+            room.memberUsernames.push_back(text);
+        }
+        if (version >= 3 && !readEncodedCount(body, pos, room.historyBase)) {
+            return false;
+        }
+        if (!readEncodedCount(body, pos, count) || count > UINT32_MAX - room.historyBase) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!readEncodedString(body, pos, text)) {
+                return false;
+            }
+            // Version 1 history has no sequence numbers in the message prefix
+            if (version == 1 && text.compare(0, roomName.size() + 3, "[" + roomName + "] ") == 0) {
+                text = "[" + roomName + " #" + std::to_string(i + 1) + text.substr(roomName.size() + 1);
+            }
+            room.messageHistory.push_back(std::make_shared<const std::string>(text));
+        }
+    }
+    if (!readEncodedCount(body, pos, count)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        std::string username;
+        UserProfile profile;
+        if (!readEncodedString(body, pos, username) || !readEncodedString(body, pos, profile.profilePicture) || !readEncodedString(body, pos, profile.statusMessage)) {
+            return false;
+        }
+        snapshot.profiles[username] = profile;
+    }
+    if (version >= 2) {
+        if (!readEncodedCount(body, pos, count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            std::string username, roomName;
+            uint32_t roomCount;
+            if (!readEncodedString(body, pos, username) || !readEncodedCount(body, pos, roomCount)) {
+                return false;
+            }
+            for (uint32_t r = 0; r < roomCount; ++r) {
+                if (!readEncodedString(body, pos, roomName) || !readEncodedCount(body, pos, value)) {
+                    return false;
+                }
+                snapshot.readCursors[username][roomName] = value;
+            }
+        }
+    }
+    return pos == body.size();
+}
+
+// Writes to a temporary file first so a crash mid-write never leaves a torn
+// snapshot behind, then replaces the old snapshot in a single step.
+bool writeServerSnapshot(const ServerSnapshot& snapshot) {
+    std::string encoded = encodeServerSnapshot(snapshot);
+    std::string temporaryFile = snapshotFile + ".tmp";
+    std::ofstream file(temporaryFile, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        return false;
+    }
+    file.write(encoded.data(), static_cast<std::streamsize>(encoded.size()));
+    file.close();
+    if (!file) {
+        return false;
+    }
+    return MoveFileExA(temporaryFile.c_str(), snapshotFile.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+}
+
+void snapshotWriter() {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(SNAPSHOT_INTERVAL_SECONDS));
+        std::lock_guard<std::mutex> lock(snapshotMutex);
+        captureServerState(snapshotState);
+        if (!writeServerSnapshot(snapshotState)) {
+            std::cerr << "Failed to write state snapshot." << std::endl;
+        }
+    }
+}
+
+// Rebuilds rooms, roles, bans, filters, history, profiles and read cursors from the last
+// snapshot. Connections are not restored; members are put back into their rooms
+// when they authenticate again.
+bool readServerSnapshot(const std::string& fileName, ServerSnapshot& snapshot) {
+    std::ifstream file(fileName, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    std::string encoded((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    file.close();
+    if (!decodeServerSnapshot(encoded, snapshot)) {
+        std::cerr << "Ignoring corrupt state snapshot " << fileName << "." << std::endl;
+        snapshot = ServerSnapshot();
+        return false;
+    }
+    return true;
+}
+
+// Every restored room and user is marked, so the first capture after a restart
+// copies the whole state once.
+bool loadServerSnapshot() {
+    ServerSnapshot snapshot;
+    std::string loadedFile = snapshotFile;
+    if (!readServerSnapshot(loadedFile, snapshot)) {
+        // A crash before the temporary file replaced the snapshot leaves the newest state there
+        loadedFile = snapshotFile + ".tmp";
+        if (!readServerSnapshot(loadedFile, snapshot)) {
+            return false;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    for (auto& entry : snapshot.rooms) {
+        const std::string& roomName = entry.first;
+        RoomSnapshot& room = entry.second;
+        ChatRoom& chatRoom = chatRooms[roomName];
+        chatRoom.name = roomName;
+        chatRoom.roles = room.roles;
+        chatRoom.bannedUsers = room.bannedUsers;
+        chatRoom.filterWords = room.filterWords;
+        chatRoom.contentFilter = room.filterWords.empty() ? nullptr : compileContentFilter(room.filterWords);
+        chatRoom.messageHistory.clear();
+        chatRoom.historyBase = room.historyBase;
+        for (size_t i = 0; i < room.messageHistory.size(); ++i) {
+            std::unordered_map<std::string, uint32_t> searchTerms = countSearchTerms(roomMessageText(*room.messageHistory[i]));
+            retainRoomMessage(chatRoom, room.messageHistory[i], searchTerms);
+            indexRoomMessage(roomName, room.historyBase + static_cast<uint32_t>(i + 1), searchTerms);
+        }
+        for (const std::string& username : room.memberUsernames) {
+            restoredMemberships[username].push_back(roomName);
+            markUserForSnapshot(username);
+        }
+        indexRoomMemberCount(roomName, 0);
+        markRoomForSnapshot(roomName, true);
+    }
+    evictRoomHistory();
+    for (const auto& profile : snapshot.profiles) {
+        savedProfiles[profile.first] = profile.second;
+        markUserForSnapshot(profile.first);
+    }
+    for (const auto& cursors : snapshot.readCursors) {
+        readCursors[cursors.first].insert(cursors.second.begin(), cursors.second.end());
+        markUserForSnapshot(cursors.first);
+    }
+    std::cout << "Restored " << snapshot.rooms.size() << " chat rooms from " << loadedFile << "." << std::endl;
+    return true;
+}
+
+// Puts a reconnecting user back into the rooms they were in before the restart.
+void restoreUserSession(const std::string& username, SOCKET clientSocket) {
+    std::vector<std::string> rooms;
+    bool hasProfile;
+    UserProfile savedProfile;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        auto profile = savedProfiles.find(username);
+        hasProfile = profile != savedProfiles.end();
+        if (hasProfile) {
+            savedProfile = profile->second;
+            for (auto& client : clients) {
+                if (client.socket == clientSocket) {
+                    client.profilePicture = profile->second.profilePicture;
+                    client.statusMessage = profile->second.statusMessage;
+                }
+            }
+        }
+        auto membership = restoredMemberships.find(username);
+        if (membership != restoredMemberships.end()) {
+            rooms.swap(membership->second);
+            restoredMemberships.erase(membership);
+            markUserForSnapshot(username);
+        }
+    }
+    if (hasProfile) {
+        markPresenceProfileChanged(username, savedProfile.statusMessage);
+    }
+    for (const std::string& roomName : rooms) {
+        if (!isRoomOwnedLocally(roomName)) {
+            requestRoomJoin(roomName, username, true);
+        }
+        else if (joinChatRoom(roomName, clientSocket, username)) {
+            std::string response = "Rejoined chat room: " + roomName + "\n";
+            sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+            presenceJoinRoom(roomName, username, clientSocket);
+        }
+    }
+}
+
+// Decides a join requested by another node for a room this node owns, and
+// answers that node. Rejoins after a login skip the room creation quota, as
+// they do locally.
+void handleRemoteRoomJoin(const std::string& roomName, const std::string& username, bool rejoin, const std::string& nodeId) {
+    std::string overload;
+    if (!rejoin && !chatRoomExists(roomName) && !admitRoomCreation(username, overload)) {
+        sendClusterNotice(nodeId, username, "[Overload] " + overload + "\n");
+        return;
+    }
+    uint32_t lastSequence;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        if (!admitRoomMember(roomName, username)) {
+            lastSequence = UINT32_MAX;
+        }
+        else {
+            lastSequence = lastRoomSequence(chatRooms[roomName]);
+        }
+    }
+    if (lastSequence == UINT32_MAX) {
+        if (!rejoin) {
+            sendClusterNotice(nodeId, username, "You are banned from the chat room: " + roomName + "\n");
+        }
+        return;
+    }
+    std::vector<std::string> fields = { roomName, username, std::to_string(lastSequence), rejoin ? "1" : "0" };
+    queueClusterFrame(nodeId, encodeClusterFrame(ClusterFrameType::JoinAccepted, fields));
+}
+
+// Completes a join the room's owner has accepted.
+void completeRemoteRoomJoin(const std::string& roomName, const std::string& username, uint32_t lastSequence, bool rejoin) {
+    SOCKET clientSocket;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        auto user = usernameSockets.find(username);
+        if (user == usernameSockets.end()) {
+            return;
+        }
+        clientSocket = user->second;
+        size_t memberCount = insertRoomMember(roomName, clientSocket, username, lastSequence);
+        indexRoomMemberCount(roomName, memberCount);
+        updateRoomSubscription(roomName, memberCount);
+    }
+    std::string response = (rejoin ? "Rejoined chat room: " : "Joined chat room: ") + roomName + "\n";
+    sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+    presenceJoinRoom(roomName, username, clientSocket);
+}
+
+// Publishes a message forwarded by another node, after the checks only the
+// owner can make. Refusals go back to the sender's node.
+void publishRemoteRoomMessage(const std::string& roomName, const std::string& senderUsername, const std::string& roomMessage, const std::string& nodeId) {
+    std::shared_ptr<const ContentFilter> contentFilter;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        auto it = chatRooms.find(roomName);
+        if (it != chatRooms.end()) {
+            contentFilter = it->second.contentFilter;
+        }
+    }
+    if (contentFilter != nullptr && contentFilterMatches(*contentFilter, roomMessage)) {
+        sendClusterNotice(nodeId, senderUsername, "[Moderation] Your message was blocked by the content filter of chat room: " + roomName + "\n");
+    }
+    else if (!publishRoomMessage(roomName, senderUsername, roomMessage)) {
+        sendClusterNotice(nodeId, senderUsername, "You are banned from the chat room: " + roomName + "\n");
+    }
+}
+
+// Applies one frame received from an authenticated peer node. Peers may only
+// announce their own users and subscriptions.
+void handleClusterFrame(const std::string& payload, const std::string& peerNodeId) {
+    size_t pos = 0;
+    uint32_t type;
+    if (!readEncodedCount(payload, pos, type)) {
+        return;
+    }
+    std::vector<std::string> fields;
+    std::string field;
+    while (pos < payload.size() && readEncodedString(payload, pos, field)) {
+        fields.push_back(field);
+    }
+
+    switch (static_cast<ClusterFrameType>(type)) {
+    case ClusterFrameType::Hello:
+        break;
+    case ClusterFrameType::RoomMessage:
+        if (fields.size() == 3 && isRoomOwnedLocally(fields[0])) {
+            publishRemoteRoomMessage(fields[0], fields[1], fields[2], peerNodeId);
+        }
+        break;
+    case ClusterFrameType::Deliver:
+        // Only the room's owner sequences its messages
+        if (fields.size() == 2 && roomOwnerNode(fields[0]) == peerNodeId) {
+            deliverRemoteRoomMessage(fields[0], fields[1]);
+        }
+        break;
+    case ClusterFrameType::Subscribe:
+    case ClusterFrameType::Unsubscribe:
+        if (fields.size() == 2 && fields[1] == peerNodeId) {
+            std::lock_guard<std::mutex> lock(clusterMutex);
+            if (static_cast<ClusterFrameType>(type) == ClusterFrameType::Subscribe) {
+                roomSubscribers[fields[0]].insert(fields[1]);
+            }
+            else {
+                roomSubscribers[fields[0]].erase(fields[1]);
+            }
+        }
+        break;
+    case ClusterFrameType::PrivateMessage:
+        if (fields.size() == 3) {
+            deliverPrivateMessage(fields[0], fields[1], fields[2]);
+        }
+        break;
+    case ClusterFrameType::UserOnline:
+    case ClusterFrameType::UserOffline:
+        if (fields.size() == 2 && fields[1] == peerNodeId) {
+            std::lock_guard<std::mutex> lock(clusterMutex);
+            if (static_cast<ClusterFrameType>(type) == ClusterFrameType::UserOnline) {
+                userDirectory[fields[0]] = fields[1];
+            }
+            else if (userDirectory.count(fields[0]) != 0 && userDirectory[fields[0]] == fields[1]) {
+                userDirectory.erase(fields[0]);
+            }
+        }
+        break;
+    case ClusterFrameType::RoomJoin:
+        if (fields.size() == 3 && isRoomOwnedLocally(fields[0])) {
+            handleRemoteRoomJoin(fields[0], fields[1], fields[2] == "1", peerNodeId);
+        }
+        break;
+    case ClusterFrameType::JoinAccepted: {
+        uint32_t lastSequence;
+        if (fields.size() == 4 && roomOwnerNode(fields[0]) == peerNodeId && parseSequenceNumber(fields[2], lastSequence)) {
+            completeRemoteRoomJoin(fields[0], fields[1], lastSequence, fields[3] == "1");
+        }
+        break;
+    }
+    case ClusterFrameType::Moderate:
+        if (fields.size() == 4 && isRoomOwnedLocally(fields[1])) {
+            sendClusterNotice(peerNodeId, fields[2], moderateChatRoom(fields[0], fields[1], fields[2], fields[3]));
+        }
+        break;
+    case ClusterFrameType::RemoveMember:
+        if (fields.size() == 3 && roomOwnerNode(fields[0]) == peerNodeId) {
+            bool connected;
+            removeLocalRoomMember(fields[0], fields[1], fields[2] == "1", connected);
+        }
+        break;
+    case ClusterFrameType::Notice:
+        if (fields.size() == 2) {
+            deliverNotice(fields[0], fields[1]);
+        }
+        break;
+    }
+}
+
+// Returns false if 'in' does not yet hold a complete frame at 'pos'.
+bool extractClusterFrame(const std::string& in, size_t& pos, std::string& payload) {
+    size_t cursor = pos;
+    uint32_t length = 0;
+    for (int shift = 0;; shift += 7) {
+        if (cursor >= in.size() || shift > 28) {
+            return false;
+        }
+        unsigned char byte = static_cast<unsigned char>(in[cursor++]);
+        length |= static_cast<uint32_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+    }
+    if (length > in.size() - cursor) {
+        return false;
+    }
+    payload = in.substr(cursor, length);
+    pos = cursor + length;
+    return true;
+}
+
+// Returns the configured peer that 'address' belongs to, or null.
+std::shared_ptr<ClusterPeer> findClusterPeerByAddress(unsigned long address) {
+    for (const auto& peer : clusterPeers) {
+        if (peer.second->address == address) {
+            return peer.second;
+        }
+    }
+    return nullptr;
+}
+
+// Checks the Hello that must open every inbound link: it has to name a
+// configured peer at the address the link came from and carry the cluster key.
+bool acceptClusterHello(const std::string& payload, unsigned long address, std::string& peerNodeId) {
+    size_t pos = 0;
+    uint32_t type;
+    std::string nodeId;
+    std::string key;
+    if (!readEncodedCount(payload, pos, type) || static_cast<ClusterFrameType>(type) != ClusterFrameType::Hello ||
+        !readEncodedString(payload, pos, nodeId) || !readEncodedString(payload, pos, key) || pos != payload.size()) {
+        return false;
+    }
+    auto it = clusterPeers.find(nodeId);
+    if (it == clusterPeers.end() || it->second->address != address || key != clusterKey) {
+        return false;
+    }
+    peerNodeId = nodeId;
+    return true;
+}
+
+// Reads length-prefixed frames from one inbound peer connection.
+void clusterPeerReader(SOCKET peerSocket, unsigned long address) {
+    char buffer[BUFFER_SIZE];
+    std::string pending;
+    std::string peerNodeId;
+    uint64_t linkGeneration = 0;
+    bool rejected = false;
+    while (!rejected) {
+        int bytesRead = recv(peerSocket, buffer, BUFFER_SIZE, 0);
+        if (bytesRead <= 0) {
+            break;
+        }
+        pending.append(buffer, bytesRead);
+        size_t pos = 0;
+        std::string payload;
+        while (extractClusterFrame(pending, pos, payload)) {
+            if (!peerNodeId.empty()) {
+                handleClusterFrame(payload, peerNodeId);
+            }
+            else if (acceptClusterHello(payload, address, peerNodeId)) {
+                std::lock_guard<std::mutex> lock(clusterMutex);
+                linkGeneration = ++peerLinkGenerations[peerNodeId];
+            }
+            else {
+                rejected = true;
+                break;
+            }
+        }
+        pending.erase(0, pos);
+        if (peerNodeId.empty() && pending.size() > BUFFER_SIZE) {
+            rejected = true;
+        }
+    }
+    closesocket(peerSocket);
+    if (rejected) {
+        std::cerr << "Rejected cluster link that did not identify as a configured peer." << std::endl;
+    }
+
+    // A node that drops its link takes its users with it, unless it has
+    // already reconnected and resynced over a newer link
+    if (!peerNodeId.empty()) {
+        std::lock_guard<std::mutex> lock(clusterMutex);
+        if (peerLinkGenerations[peerNodeId] != linkGeneration) {
+            return;
+        }
+        for (auto it = userDirectory.begin(); it != userDirectory.end();) {
+            it = it->second == peerNodeId ? userDirectory.erase(it) : std::next(it);
+        }
+        for (auto& subscribers : roomSubscribers) {
+            subscribers.second.erase(peerNodeId);
+        }
+    }
+}
+
+void clusterListener(SOCKET listeningSocket) {
+    while (true) {
+        sockaddr_in peerAddress;
+        int peerAddressSize = sizeof(peerAddress);
+        SOCKET peerSocket = accept(listeningSocket, reinterpret_cast<sockaddr*>(&peerAddress), &peerAddressSize);
+        if (peerSocket == INVALID_SOCKET) {
+            std::cerr << "Failed to accept cluster connection." << std::endl;
+            continue;
+        }
+        if (!findClusterPeerByAddress(peerAddress.sin_addr.s_addr)) {
+            std::cerr << "Refused cluster connection from " << inet_ntoa(peerAddress.sin_addr) << "." << std::endl;
+            closesocket(peerSocket);
+            continue;
+        }
+        std::thread readerThread(clusterPeerReader, peerSocket, static_cast<unsigned long>(peerAddress.sin_addr.s_addr));
+        readerThread.detach();
+    }
+}
+
+// Frames that bring a freshly (re)connected peer up to date: who we are, which
+// users are connected here and which of its rooms we need.
+std::string buildClusterResync(const std::string& peerNodeId) {
+    std::vector<std::string> hello = { localNodeId, clusterKey };
+    std::string frames = encodeClusterFrame(ClusterFrameType::Hello, hello);
+    std::vector<std::string> usernames;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        for (const auto& session : usernameSockets) {
+            usernames.push_back(session.first);
+        }
+    }
+    for (const std::string& username : usernames) {
+        std::vector<std::string> fields = { username, localNodeId };
+        frames += encodeClusterFrame(ClusterFrameType::UserOnline, fields);
+    }
+    std::lock_guard<std::mutex> lock(clusterMutex);
+    for (const std::string& roomName : subscribedRooms) {
+        if (roomOwnerNode(roomName) == peerNodeId) {
+            std::vector<std::string> fields = { roomName, localNodeId };
+            frames += encodeClusterFrame(ClusterFrameType::Subscribe, fields);
+        }
+    }
+    return frames;
+}
+
+SOCKET connectToClusterPeer(const ClusterPeer& peer) {
+    SOCKET peerSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (peerSocket == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+    sockaddr_in peerAddress;
+    memset(&peerAddress, 0, sizeof(peerAddress));
+    peerAddress.sin_family = AF_INET;
+    peerAddress.sin_port = htons(static_cast<u_short>(peer.port));
+    peerAddress.sin_addr.s_addr = inet_addr(peer.host.c_str());
+    if (connect(peerSocket, reinterpret_cast<sockaddr*>(&peerAddress), sizeof(peerAddress)) == SOCKET_ERROR) {
+        closesocket(peerSocket);
+        return INVALID_SOCKET;
+    }
+    return peerSocket;
+}
+
+// Owns the outbound link to one peer. Everything queued while a send is in
+// progress goes out together in the next send, so the link batches under load.
+void clusterPeerSender(std::shared_ptr<ClusterPeer> peer) {
+    SOCKET peerSocket = INVALID_SOCKET;
+    std::string batch;
+    while (true) {
+        if (peerSocket == INVALID_SOCKET) {
+            peerSocket = connectToClusterPeer(*peer);
+            if (peerSocket == INVALID_SOCKET) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(CLUSTER_RECONNECT_DELAY_MS));
+                continue;
+            }
+            std::cout << "Connected to cluster node " << peer->nodeId << "." << std::endl;
+            {
+                std::lock_guard<std::mutex> lock(peer->mutex);
+                if (peer->overflowed) {
+                    batch.clear();
+                    peer->overflowed = false;
+                }
+                peer->socket = peerSocket;
+            }
+            batch = buildClusterResync(peer->nodeId) + batch;
+        }
+        if (batch.empty()) {
+            std::unique_lock<std::mutex> lock(peer->mutex);
+            peer->outboxCV.wait(lock, [&] { return !peer->outbox.empty() || peer->overflowed; });
+            if (peer->overflowed) {
+                // Reconnect so the peer drops what it knows about us and resyncs
+                peer->socket = INVALID_SOCKET;
+                lock.unlock();
+                std::cerr << "Cluster outbox for node " << peer->nodeId << " overflowed." << std::endl;
+                closesocket(peerSocket);
+                peerSocket = INVALID_SOCKET;
+                continue;
+            }
+            batch.swap(peer->outbox);
+        }
+        size_t sent = 0;
+        while (sent < batch.size()) {
+            int result = send(peerSocket, batch.data() + sent, static_cast<int>(batch.size() - sent), 0);
+            if (result == SOCKET_ERROR || result == 0) {
+                break;
+            }
+            sent += result;
+        }
+        if (sent == batch.size()) {
+            batch.clear();
+            continue;
+        }
+        // Keep every frame the peer did not get whole and resend them after
+        // reconnecting. A partial frame must not follow the new link's resync
+        // frames, or the peer would read its tail as a length prefix.
+        size_t boundary = 0;
+        size_t pos = 0;
+        std::string payload;
+        while (extractClusterFrame(batch, pos, payload) && pos <= sent) {
+            boundary = pos;
+        }
+        batch.erase(0, boundary);
+        std::cerr << "Lost cluster link to node " << peer->nodeId << "." << std::endl;
+        {
+            std::lock_guard<std::mutex> lock(peer->mutex);
+            peer->socket = INVALID_SOCKET;
+        }
+        closesocket(peerSocket);
+        peerSocket = INVALID_SOCKET;
+    }
+}
+
+void announceUserPresence(const std::string& username, bool online) {
+    if (!clusterEnabled || username.empty()) {
+        return;
+    }
+    std::vector<std::string> fields = { username, localNodeId };
+    broadcastClusterFrame(encodeClusterFrame(online ? ClusterFrameType::UserOnline : ClusterFrameType::UserOffline, fields));
+}
+
+// Puts a timer into the slot matching how far away it expires. Timers beyond the
+// wheel's range wait in the last level and are re-linked when they come around.
+void linkTimer(TimerEntry* timer) {
+    uint64_t delta = timer->expiryTick > timerCurrentTick ? timer->expiryTick - timerCurrentTick : 0;
+    uint64_t slotTick = timer->expiryTick;
+    uint64_t range = 1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+    if (delta >= range) {
+        slotTick = timerCurrentTick + range - 1;
+        delta = range - 1;
+    }
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+        ++level;
+    }
+    timer->level = level;
+    timer->slot = static_cast<int>((slotTick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1));
+    TimerEntry*& head = timerSlots[timer->level][timer->slot];
+    timer->prev = nullptr;
+    timer->next = head;
+    if (head != nullptr) {
+        head->prev = timer;
+    }
+    head = timer;
+}
+
+void unlinkTimer(TimerEntry* timer) {
+    if (timer->prev != nullptr) {
+        timer->prev->next = timer->next;
+    }
+    else {
+        timerSlots[timer->level][timer->slot] = timer->next;
+    }
+    if (timer->next != nullptr) {
+        timer->next->prev = timer->prev;
+    }
+    timer->prev = timer->next = nullptr;
+}
+
+// Detaches a whole slot and returns its timers.
+TimerEntry* takeTimerSlot(int level, int slot) {
+    TimerEntry* head = timerSlots[level][slot];
+    timerSlots[level][slot] = nullptr;
+    return head;
+}
+
+// Runs 'callback' on the timer thread after 'delayMs'. Callbacks must be short
+// and may schedule or cancel timers themselves.
+uint64_t scheduleTimer(int delayMs, std::function<void()> callback) {
+    uint64_t ticks = delayMs <= 0 ? 1 : (static_cast<uint64_t>(delayMs) + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    std::unique_ptr<TimerEntry> timer(new TimerEntry());
+    timer->callback = callback;
+    std::lock_guard<std::mutex> lock(timerMutex);
+    timer->id = nextTimerId++;
+    timer->expiryTick = timerCurrentTick + ticks;
+    linkTimer(timer.get());
+    uint64_t timerId = timer->id;
+    activeTimers[timerId] = std::move(timer);
+    return timerId;
+}
+
+bool cancelTimer(uint64_t timerId) {
+    std::lock_guard<std::mutex> lock(timerMutex);
+    auto it = activeTimers.find(timerId);
+    if (it == activeTimers.end()) {
+        return false;
+    }
+    unlinkTimer(it->second.get());
+    activeTimers.erase(it);
+    return true;
+}
+
+// Advances the wheel by one tick and moves the callbacks that are now due into
+// 'expired'. Caller holds timerMutex.
+void advanceTimerWheel(std::vector<std::function<void()>>& expired) {
+    ++timerCurrentTick;
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+        if ((timerCurrentTick & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) != 0) {
+            break;
+        }
+        int slot = static_cast<int>((timerCurrentTick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1));
+        TimerEntry* timer = takeTimerSlot(level, slot);
+        while (timer != nullptr) {
+            TimerEntry* next = timer->next;
+            linkTimer(timer);
+            timer = next;
+        }
+    }
+
+    TimerEntry* timer = takeTimerSlot(0, static_cast<int>(timerCurrentTick & (TIMER_WHEEL_SLOTS - 1)));
+    while (timer != nullptr) {
+        TimerEntry* next = timer->next;
+        if (timer->expiryTick > timerCurrentTick) {
+            linkTimer(timer);
+        }
+        else {
+            auto it = activeTimers.find(timer->id);
+            expired.push_back(std::move(timer->callback));
+            activeTimers.erase(it);
+        }
+        timer = next;
+    }
+}
+
+void timerWheelRunner() {
+    auto nextTick = std::chrono::steady_clock::now() + std::chrono::milliseconds(TIMER_TICK_MS);
+    std::vector<std::function<void()>> expired;
+    while (true) {
+        std::this_thread::sleep_until(nextTick);
+        {
+            std::lock_guard<std::mutex> lock(timerMutex);
+            // Catch up on ticks missed while callbacks ran long
+            auto now = std::chrono::steady_clock::now();
+            while (nextTick <= now) {
+                advanceTimerWheel(expired);
+                nextTick += std::chrono::milliseconds(TIMER_TICK_MS);
+            }
+        }
+        for (auto& callback : expired) {
+            callback();
+        }
+        expired.clear();
+    }
+}
+
+// Timer callbacks and room deliveries write to sockets outside connectionsMutex. While a connection
+// is pinned its handler does not close the socket, so the number cannot be
+// recycled under the callback. Callers of pinConnection must hold connectionsMutex.
+bool pinConnection(SOCKET clientSocket, uint64_t connectionId) {
+    auto it = connections.find(clientSocket);
+    if (it == connections.end() || it->second.id != connectionId) {
+        return false;
+    }
+    ++it->second.pins;
+    return true;
+}
+
+void unpinConnections(const std::vector<SOCKET>& sockets) {
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        for (SOCKET clientSocket : sockets) {
+            auto it = connections.find(clientSocket);
+            if (it != connections.end()) {
+                --it->second.pins;
+            }
+        }
+    }
+    connectionsCV.notify_all();
+}
+
+// Sends a short line only if it can go out without blocking. A client that has
+// stopped reading must not stall the timer thread; such a line is dropped.
+void trySendToClient(SOCKET clientSocket, const std::string& line) {
+    fd_set writable;
+    FD_ZERO(&writable);
+    FD_SET(clientSocket, &writable);
+    timeval noWait = { 0, 0 };
+    if (select(static_cast<int>(clientSocket) + 1, nullptr, &writable, nullptr, &noWait) == 1) {
+        sendToClient(clientSocket, line.c_str(), static_cast<int>(line.length()));
+    }
+}
+
+// Shuts the connection down if it is still the one identified by 'connectionId',
+// which makes its handler's recv return so the handler cleans up. Sockets are
+// only closed by their handler, so a recycled socket number is never touched.
+void closeConnectionIf(SOCKET clientSocket, uint64_t connectionId, const std::string& reason) {
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        if (!pinConnection(clientSocket, connectionId)) {
+            return;
+        }
+    }
+    trySendToClient(clientSocket, "[Notification] " + reason + "\n");
+    shutdown(clientSocket, SD_BOTH);
+    unpinConnections(std::vector<SOCKET>(1, clientSocket));
+}
+
+int millisecondsSince(std::chrono::steady_clock::time_point then) {
+    return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - then).count());
+}
+
+void checkIdleConnection(SOCKET clientSocket, uint64_t connectionId) {
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        auto it = connections.find(clientSocket);
+        if (it == connections.end() || it->second.id != connectionId) {
+            return;
+        }
+        int silentMs = millisecondsSince(it->second.lastActivity);
+        if (silentMs < IDLE_TIMEOUT_MS) {
+            it->second.idleTimer = scheduleTimer(IDLE_TIMEOUT_MS - silentMs, std::bind(checkIdleConnection, clientSocket, connectionId));
+            return;
+        }
+    }
+    closeConnectionIf(clientSocket, connectionId, "Connection closed after being idle.");
+}
+
+void sendHeartbeat(SOCKET clientSocket, uint64_t connectionId) {
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        auto it = connections.find(clientSocket);
+        if (it == connections.end() || it->second.id != connectionId) {
+            return;
+        }
+        int silentMs = millisecondsSince(it->second.lastActivity);
+        if (silentMs < HEARTBEAT_INTERVAL_MS) {
+            it->second.heartbeatTimer = scheduleTimer(HEARTBEAT_INTERVAL_MS - silentMs, std::bind(sendHeartbeat, clientSocket, connectionId));
+            return;
+        }
+        it->second.heartbeatTimer = scheduleTimer(HEARTBEAT_INTERVAL_MS, std::bind(sendHeartbeat, clientSocket, connectionId));
+        pinConnection(clientSocket, connectionId);
+    }
+    trySendToClient(clientSocket, "PING\n");
+    unpinConnections(std::vector<SOCKET>(1, clientSocket));
+}
+
+// Registers a new connection and arms its handshake deadline, heartbeat and idle timers.
+void openConnection(SOCKET clientSocket, const std::string& address) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    Connection& connection = connections[clientSocket];
+    connection.id = nextConnectionId++;
+    connection.address = address;
+    connection.lastActivity = std::chrono::steady_clock::now();
+    connection.pins = 0;
+    connection.handshakeTimer = scheduleTimer(HANDSHAKE_TIMEOUT_MS, std::bind(closeConnectionIf, clientSocket, connection.id, std::string("Handshake timed out.")));
+    connection.heartbeatTimer = scheduleTimer(HEARTBEAT_INTERVAL_MS, std::bind(sendHeartbeat, clientSocket, connection.id));
+    connection.idleTimer = scheduleTimer(IDLE_TIMEOUT_MS, std::bind(checkIdleConnection, clientSocket, connection.id));
+}
+
+void touchConnection(SOCKET clientSocket) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    auto it = connections.find(clientSocket);
+    if (it != connections.end()) {
+        it->second.lastActivity = std::chrono::steady_clock::now();
+    }
+}
+
+std::string getConnectionAddress(SOCKET clientSocket) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    auto it = connections.find(clientSocket);
+    return it != connections.end() ? it->second.address : "";
+}
+
+// Connections are only accepted and registered on the accept thread, so the
+// count checked here cannot be overtaken before the new one is registered.
+bool admitConnection(const std::string& address, std::string& reason) {
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        if (connections.size() >= static_cast<size_t>(MAX_CLIENTS)) {
+            reason = "The server is full, try again later.";
+            return false;
+        }
+    }
+    if (!admitToken(ipConnectBuckets, address, IP_CONNECT_RATE_PER_SECOND, IP_CONNECT_BURST)) {
+        reason = "Too many connections from your address, slow down.";
+        return false;
+    }
+    return true;
+}
+
+// HEARTBEAT and PONG only keep a connection open, before or after login.
+bool isKeepAlive(const std::string& message) {
+    return message == "HEARTBEAT" || message == "PONG";
+}
+
+// Sheds a command when too many are already executing or when its sender, or
+// its address before login, exceeds the command rate. Keep-alives and EXIT are
+// never shed. An admitted command must release its slot in commandsInFlight.
+bool admitCommand(SOCKET clientSocket, const std::string& message, std::string& reason) {
+    bool exempt = isKeepAlive(message) || message.substr(0, 4) == "EXIT";
+    if (++commandsInFlight > MAX_COMMANDS_IN_FLIGHT && !exempt) {
+        --commandsInFlight;
+        reason = "The server is busy, try again later.";
+        return false;
+    }
+    std::string username = getUsernameForSocket(clientSocket);
+    std::string key = username.empty() ? getConnectionAddress(clientSocket) : username;
+    if (!exempt && !admitToken(userCommandBuckets, key, USER_COMMAND_RATE_PER_SECOND, USER_COMMAND_BURST)) {
+        --commandsInFlight;
+        reason = "You are sending commands too quickly.";
+        return false;
+    }
+    return true;
+}
+
+void pruneRateLimitBuckets() {
+    {
+        std::lock_guard<std::mutex> lock(rateLimitMutex);
+        pruneIdleBuckets(userMessageBuckets, USER_MESSAGE_RATE_PER_SECOND, USER_MESSAGE_BURST);
+        pruneIdleBuckets(ipConnectBuckets, IP_CONNECT_RATE_PER_SECOND, IP_CONNECT_BURST);
+        pruneIdleBuckets(userCommandBuckets, USER_COMMAND_RATE_PER_SECOND, USER_COMMAND_BURST);
+        pruneIdleBuckets(roomMessageBuckets, ROOM_MESSAGE_RATE_PER_SECOND, ROOM_MESSAGE_BURST);
+        pruneIdleBuckets(roomCreateBuckets, ROOM_CREATE_RATE_PER_SECOND, ROOM_CREATE_BURST);
+    }
+    scheduleTimer(RATE_LIMIT_PRUNE_INTERVAL_MS, pruneRateLimitBuckets);
+}
+
+void completeHandshake(SOCKET clientSocket) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    auto it = connections.find(clientSocket);
+    if (it != connections.end()) {
+        cancelTimer(it->second.handshakeTimer);
+    }
+}
+
+// Traffic captures hold one line per received command, "<session> <command>",
+// and a bare "<session>" line when the session closes. Commands up to the first
+// successful AUTHENTICATE are handshake requests. Captures contain passwords as
+// sent by clients.
+void recordTraffic(uint64_t connectionId, const std::string* line) {
+    std::lock_guard<std::mutex> lock(trafficRecordMutex);
+    trafficRecord << connectionId;
+    if (line != nullptr) {
+        trafficRecord << ' ' << *line;
+    }
+    trafficRecord << '\n';
+}
+
+void recordReceivedLine(SOCKET clientSocket, const std::string& line) {
+    if (!trafficRecord.is_open()) {
+        return;
+    }
+    uint64_t connectionId;
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        auto it = connections.find(clientSocket);
+        if (it == connections.end()) {
+            return;
+        }
+        connectionId = it->second.id;
+    }
+    recordTraffic(connectionId, &line);
+}
+
+// Cancels the connection's timers and closes its socket once no timer callback
+// is using it. Called once by the handler, after the session has left its rooms.
+void closeConnection(SOCKET clientSocket) {
+    flushFanoutDeliveries(clientSocket);
+    std::unique_lock<std::mutex> lock(connectionsMutex);
+    connectionsCV.wait(lock, [clientSocket] {
+        auto pinned = connections.find(clientSocket);
+        return pinned == connections.end() || pinned->second.pins == 0;
+    });
+    auto it = connections.find(clientSocket);
+    if (it != connections.end()) {
+        if (trafficRecord.is_open()) {
+            recordTraffic(it->second.id, nullptr);
+        }
+        cancelTimer(it->second.handshakeTimer);
+        cancelTimer(it->second.heartbeatTimer);
+        cancelTimer(it->second.idleTimer);
+        connections.erase(it);
+    }
+    closesocket(clientSocket);
+    connectionsCV.notify_all();
+}
+
+// Reads the next newline-terminated command, keeping any bytes past it in
+// 'pending' for the next call. Returns false once the peer has gone away.
+bool receiveLine(SOCKET clientSocket, std::string& pending, std::string& line) {
+    char buffer[BUFFER_SIZE];
+    size_t newline;
+    while ((newline = pending.find('\n')) == std::string::npos) {
+        if (pending.size() > MAX_COMMAND_LENGTH) {
+            std::cerr << "Client command too long." << std::endl;
+            return false;
+        }
+        int bytesRead = recv(clientSocket, buffer, BUFFER_SIZE, 0);
+        if (bytesRead == SOCKET_ERROR) {
+            std::cerr << "Error receiving data from client." << std::endl;
+            return false;
+        }
+        if (bytesRead == 0) {
+            return false;
+        }
+        touchConnection(clientSocket);
+        pending.append(buffer, bytesRead);
+    }
+    line = pending.substr(0, newline);
+    pending.erase(0, newline + 1);
+    if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+    }
+    recordReceivedLine(clientSocket, line);
+    return true;
+}
+
+void requestShutdown(int) {
+    shutdownRequested = true;
+}
+
+// Pins every open connection and returns their sockets.
+std::vector<SOCKET> pinAllConnections() {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    std::vector<SOCKET> sockets;
+    for (auto& connection : connections) {
+        ++connection.second.pins;
+        sockets.push_back(connection.first);
+    }
+    return sockets;
+}
+
+void forceCloseConnections() {
+    std::vector<SOCKET> sockets = pinAllConnections();
+    for (SOCKET clientSocket : sockets) {
+        shutdown(clientSocket, SD_BOTH);
+    }
+    unpinConnections(sockets);
+}
+
+// Stops accepting, asks connected clients to leave, closes whoever is still
+// connected after DRAIN_TIMEOUT_MS and writes a final state snapshot. Closed
+// sessions keep their rooms, so they are restored on restart.
+void drainConnections(SOCKET listeningSocket) {
+    closesocket(listeningSocket);
+
+    std::vector<SOCKET> sockets = pinAllConnections();
+    std::cout << "Shutting down, draining " << sockets.size() << " connections..." << std::endl;
+    for (SOCKET clientSocket : sockets) {
+        trySendToClient(clientSocket, "[Notification] Server is shutting down.\n");
+    }
+    unpinConnections(sockets);
+    scheduleTimer(DRAIN_TIMEOUT_MS, forceCloseConnections);
+    {
+        std::unique_lock<std::mutex> lock(connectionsMutex);
+        connectionsCV.wait(lock, [] { return connections.empty(); });
+    }
+
+    std::lock_guard<std::mutex> snapshotLock(snapshotMutex);
+    captureServerState(snapshotState);
+    if (!writeServerSnapshot(snapshotState)) {
+        std::cerr << "Failed to write state snapshot." << std::endl;
+    }
+}
+
+// Handles one command from an established session. Returns false when the
+// client asked to close the connection.
+bool handleClientMessage(SOCKET clientSocket, const std::string& message) {
+    if (message.substr(0, 5) == "JOIN:") {
+        std::string roomName = message.substr(5);
+        std::string username = getUsernameForSocket(clientSocket);
+        std::string overload;
+        if (!isRoomOwnedLocally(roomName)) {
+            requestRoomJoin(roomName, username, false);
+        }
+        else if (!chatRoomExists(roomName) && !admitRoomCreation(username, overload)) {
+            sendOverloadResponse(clientSocket, overload);
+        }
+        else if (joinChatRoom(roomName, clientSocket, username)) {
+            std::string response = "Joined chat room: " + roomName + "\n";
+            sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+            presenceJoinRoom(roomName, username, clientSocket);
+        }
+        else {
+            std::string response = "You are banned from the chat room: " + roomName + "\n";
+            sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+        }
+    }
+    else if (message.substr(0, 6) == "LEAVE:") {
+        std::string roomName = message.substr(6);
+        leaveChatRoom(roomName, clientSocket);
+        presenceLeaveRoom(roomName, getUsernameForSocket(clientSocket));
+        std::string response = "Left chat room: " + roomName + "\n";
+        sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+    }
+    else if (message.substr(0, 10) == "SEND_ROOM:") {
+        size_t separatorPos = message.find(':', 10);
+        if (separatorPos != std::string::npos) {
+            std::string roomName = message.substr(10, separatorPos - 10);
+            std::string roomMessage = message.substr(separatorPos + 1);
+            std::string username = getUsernameForSocket(clientSocket);
+            bool isMember;
+            std::shared_ptr<const ContentFilter> contentFilter;
+            {
+                std::lock_guard<std::mutex> lock(clientsMutex);
+                const ChatRoom* chatRoom = findMemberChatRoom(roomName, clientSocket);
+                isMember = chatRoom != nullptr;
+                if (isMember) {
+                    contentFilter = chatRoom->contentFilter;
+                }
+            }
+            if (!isMember) {
+                std::string response = "You are not a member of the chat room: " + roomName + "\n";
+                sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+            }
+            else if (!admitUserMessage(username)) {
+                std::string response = "[Moderation] You are sending messages too quickly. Message dropped.\n";
+                sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+            }
+            else if (!admitRoomMessage(roomName)) {
+                sendOverloadResponse(clientSocket, "Chat room " + roomName + " is too busy. Message dropped.");
+            }
+            else if (contentFilter != nullptr && contentFilterMatches(*contentFilter, roomMessage)) {
+                std::string response = "[Moderation] Your message was blocked by the content filter of chat room: " + roomName + "\n";
+                sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+            }
+            else {
+                clearUserTyping(roomName, username);
+                if (isRoomOwnedLocally(roomName)) {
+                    publishRoomMessage(roomName, username, roomMessage);
+                }
+                else {
+                    std::vector<std::string> fields = { roomName, username, roomMessage };
+                    queueClusterFrame(roomOwnerNode(roomName), encodeClusterFrame(ClusterFrameType::RoomMessage, fields));
+                }
+            }
+        }
+    }
+    else if (message.substr(0, 13) == "SEND_PRIVATE:") {
+        size_t separatorPos = message.find(':', 13);
+        if (separatorPos != std::string::npos) {
+            std::string recipientUsername = message.substr(13, separatorPos - 13);
+            std::string privateMessage = message.substr(separatorPos + 1);
+            if (!sendPrivateMessage(recipientUsername, privateMessage, clientSocket)) {
+                std::string response = "User is not online: " + recipientUsername + "\n";
+                sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+            }
+        }
+    }
+    else if (message.substr(0, 5) == "LIST:") {
+        // LIST:[sort][:filter][:cursor] where sort is name, members or activity. Filters
+        // ignore case; one starting with '^' matches a name prefix, any other filter a
+        // substring of any length
+        std::string arguments = message.substr(5);
+        size_t sortEnd = arguments.find(':');
+        std::string sortName = arguments.substr(0, sortEnd);
+        std::string filter;
+        std::string cursor;
+        if (sortEnd != std::string::npos) {
+            size_t filterEnd = arguments.find(':', sortEnd + 1);
+            filter = arguments.substr(sortEnd + 1, filterEnd == std::string::npos ? std::string::npos : filterEnd - sortEnd - 1);
+            if (filterEnd != std::string::npos) {
+                cursor = arguments.substr(filterEnd + 1);
+            }
+        }
+        RoomSortOrder order = sortName == "members" ? RoomSortOrder::Members : sortName == "activity" ? RoomSortOrder::Activity : RoomSortOrder::Name;
+        std::string roomList = getChatRoomList(order, filter, cursor);
+        if (roomList.empty()) {
+            roomList = "No chat rooms found.\n";
+        }
+        sendToClient(clientSocket, roomList.c_str(), static_cast<int>(roomList.length()));
+    }
+    else if (message.find(':') != std::string::npos && isModerationCommand(message.substr(0, message.find(':')))) {
+        // <command>:<room>:<user or word>, decided by the node that owns the room
+        size_t roomPos = message.find(':') + 1;
+        size_t separatorPos = message.find(':', roomPos);
+        if (separatorPos != std::string::npos) {
+            std::string command = message.substr(0, roomPos - 1);
+            std::string roomName = message.substr(roomPos, separatorPos - roomPos);
+            std::string argument = message.substr(separatorPos + 1);
+            std::string username = getUsernameForSocket(clientSocket);
+            if (isRoomOwnedLocally(roomName)) {
+                std::string response = moderateChatRoom(command, roomName, username, argument);
+                sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+            }
+            else {
+                std::vector<std::string> fields = { command, roomName, username, argument };
+                queueClusterFrame(roomOwnerNode(roomName), encodeClusterFrame(ClusterFrameType::Moderate, fields));
+            }
+        }
+        else {
+            sendToClient(clientSocket, "Invalid command.\n", 17);
+        }
+    }
+    else if (message.substr(0, 13) == "SHOW_PROFILE:") {
+        std::string username = message.substr(13);
+        sendUserProfile(username, clientSocket);
+    }
+    else if (message.substr(0, 15) == "UPDATE_PROFILE:") {
+        size_t separatorPos = message.find(':', 15);
+        if (separatorPos != std::string::npos) {
+            std::string profilePicture = message.substr(15, separatorPos - 15);
+            std::string statusMessage = message.substr(separatorPos + 1);
+            std::string username;
+            for (auto& client : clients) {
+                if (client.socket == clientSocket) {
+                    username = client.username;
+                    break;
+                }
+            }
+            updateUserProfile(username, profilePicture, statusMessage);
+            std::string response = "Profile updated successfully!\n";
+            sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+        }
+    }
+    else if (message.substr(0, 4) == "ACK:") {
+        // ACK:<room>:<sequence> marks every message up to sequence as read; no reply
+        size_t separatorPos = message.find(':', 4);
+        uint32_t sequence;
+        if (separatorPos != std::string::npos && parseSequenceNumber(message.substr(separatorPos + 1), sequence)) {
+            acknowledgeRoomMessages(getUsernameForSocket(clientSocket), message.substr(4, separatorPos - 4), sequence);
+        }
+    }
+    else if (message.substr(0, 4) == "GAP:") {
+        // GAP:<room>:<from>:<to> resends the messages numbered from..to
+        size_t fromPos = message.find(':', 4);
+        size_t toPos = fromPos == std::string::npos ? std::string::npos : message.find(':', fromPos + 1);
+        uint32_t first, last;
+        if (toPos == std::string::npos || !parseSequenceNumber(message.substr(fromPos + 1, toPos - fromPos - 1), first) ||
+            !parseSequenceNumber(message.substr(toPos + 1), last)) {
+            sendToClient(clientSocket, "Invalid command.\n", 17);
+        }
+        else {
+            sendRoomHistoryRange(clientSocket, message.substr(4, fromPos - 4), first, last);
+        }
+    }
+    else if (message.substr(0, 7) == "SEARCH:") {
+        size_t separatorPos = message.find(':', 7);
+        if (separatorPos != std::string::npos) {
+            std::string roomName = message.substr(7, separatorPos - 7);
+            if (isClientInChatRoom(roomName, clientSocket)) {
+                std::vector<uint32_t> matches = searchRoomHistory(roomName, message.substr(separatorPos + 1), firstRetainedSequence(roomName));
+                std::string found;
+                size_t matchCount = 0;
+                {
+                    std::lock_guard<std::mutex> lock(clientsMutex);
+                    const ChatRoom* chatRoom = findMemberChatRoom(roomName, clientSocket);
+                    for (size_t i = 0; chatRoom != nullptr && i < matches.size(); ++i) {
+                        // Evicted since the search ran
+                        const std::string* match = findRoomMessage(*chatRoom, matches[i]);
+                        if (match != nullptr) {
+                            found += "  " + *match;
+                            ++matchCount;
+                        }
+                    }
+                }
+                std::string response = "[Search] " + std::to_string(matchCount) + " matches in " + roomName + "\n" + found;
+                sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+            }
+            else {
+                std::string response = "You are not a member of the chat room: " + roomName + "\n";
+                sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+            }
+        }
+    }
+    else if (message.substr(0, 9) == "PRESENCE:") {
+        std::string state = message.substr(9);
+        if (state == "away" || state == "online") {
+            setUserPresence(getUsernameForSocket(clientSocket), state == "away" ? PresenceState::Away : PresenceState::Online);
+            std::string response = "Presence set to " + state + "\n";
+            sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+        }
+        else {
+            sendToClient(clientSocket, "Invalid presence state.\n", 24);
+        }
+    }
+    else if (message.substr(0, 7) == "TYPING:") {
+        std::string roomName = message.substr(7);
+        if (isClientInChatRoom(roomName, clientSocket)) {
+            setUserTyping(roomName, getUsernameForSocket(clientSocket));
+        }
+    }
+    else if (message.substr(0, 4) == "SEND") {
+        size_t separatorPos = message.find(':', 4);
+        if (separatorPos != std::string::npos) {
+            std::string fileName = message.substr(4, separatorPos - 4);
+            std::string fileData = message.substr(separatorPos + 1);
+            bool saved = saveFile(fileName, fileData);
+            std::string response = saved ? "File saved successfully!\n" : "Failed to save file.\n";
+            sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+        }
+    }
+    else if (message.substr(0, 3) == "GET") {
+        std::string fileName = message.substr(3);
+        std::string fileData = readFile(fileName);
+        std::string response = fileData.empty() ? "File not found.\n" : fileData;
+        sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+    }
+    else if (isKeepAlive(message)) {
+        // Keep-alives only refresh the connection's activity time
+    }
+    else if (message.substr(0, 4) == "EXIT") {
+        return false;
+    }
+    else {
+        sendToClient(clientSocket, "Invalid command.\n", 17);
+    }
+    return true;
+}
+
+// A connection may register and retry a failed login, but nothing else except
+// keep-alives is accepted until a login succeeds.
+enum class HandshakeResult { Authenticated, Pending, Rejected };
+
+// Handles one handshake request, which registers or logs in.
+HandshakeResult handleClientHandshake(SOCKET clientSocket, const std::string& request) {
+    if (request.substr(0, 13) == "AUTHENTICATE:") {
+        std::string credentials = request.substr(13);
+        size_t separatorPos = credentials.find(':');
+        if (separatorPos != std::string::npos) {
+            std::string username = credentials.substr(0, separatorPos);
+            std::string password = credentials.substr(separatorPos + 1);
+            bool authenticated = authenticateUser(username, password);
+            sendAuthenticationResponse(authenticated, clientSocket);
+
+            if (authenticated) {
+                std::unique_lock<std::mutex> lock(clientsMutex);
+                clients.push_back(Client{ clientSocket, username, "", "" });
+                socketUsernames[clientSocket] = username;
+                usernameSockets[username] = clientSocket;
+                lock.unlock();
+                clientCV.notify_all();
+                setUserPresence(username, PresenceState::Online);
+                announceUserPresence(username, true);
+                restoreUserSession(username, clientSocket);
+                sendUnreadMessageNotification(clientSocket);
+                sendUnreadMessages(clientSocket);
+                return HandshakeResult::Authenticated;
+            }
+            return HandshakeResult::Pending;
+        }
+    }
+    else if (request.substr(0, 9) == "REGISTER:") {
+        std::string credentials = request.substr(9);
+        size_t separatorPos = credentials.find(':');
+        if (separatorPos != std::string::npos) {
+            std::string username = credentials.substr(0, separatorPos);
+            std::string password = credentials.substr(separatorPos + 1);
+            bool registered = createUser(username, password);
+            std::string response = registered ? "Registration successful!\n" : "Registration failed. Username already exists.\n";
+            sendToClient(clientSocket, response.c_str(), static_cast<int>(response.length()));
+            return HandshakeResult::Pending;
+        }
+    }
+    else if (isKeepAlive(request)) {
+        return HandshakeResult::Pending;
+    }
+    sendToClient(clientSocket, "Invalid request.\n", 17);
+    return HandshakeResult::Rejected;
+}
+
+// Runs one command through admission control and the handlers. Returns false
+// when the client asked to close the connection.
+bool processClientCommand(SOCKET clientSocket, const std::string& message) {
+    std::string overload;
+    if (!admitCommand(clientSocket, message, overload)) {
+        sendOverloadResponse(clientSocket, overload);
+        return true;
+    }
+    bool keepOpen = handleClientMessage(clientSocket, message);
+    --commandsInFlight;
+    return keepOpen;
+}
+
+// Removes a finished session from the client list, its rooms and presence.
+// The connection itself is closed separately.
+void endClientSession(SOCKET clientSocket) {
+    std::string sessionUsername = getUsernameForSocket(clientSocket);
+    setUserPresence(sessionUsername, PresenceState::Offline);
+
+    // Remove client from the list of connected clients
+    std::unique_lock<std::mutex> lock(clientsMutex);
+    clients.erase(std::remove_if(clients.begin(), clients.end(), std::bind(clientSocketMatches, std::placeholders::_1, clientSocket)), clients.end());
+    auto session = socketUsernames.find(clientSocket);
+    if (session != socketUsernames.end()) {
+        auto owner = usernameSockets.find(session->second);
+        if (owner != usernameSockets.end() && owner->second == clientSocket) {
+            usernameSockets.erase(owner);
+        }
+        socketUsernames.erase(session);
+    }
+    bool stillConnected = usernameSockets.count(sessionUsername) != 0;
+    lock.unlock();
+    if (!stillConnected) {
+        announceUserPresence(sessionUsername, false);
+    }
+    leaveAllChatRooms(clientSocket, sessionUsername);
+}
+
+void clientHandler(SOCKET clientSocket) {
+    // Handshake requests until the client logs in. The deadline timer shuts down
+    // a connection that takes too long, which makes receiveLine fail.
+    std::string pending;
+    std::string request;
+    HandshakeResult handshake = HandshakeResult::Pending;
+    int requests = 0;
+    while (handshake == HandshakeResult::Pending) {
+        if (requests == MAX_HANDSHAKE_REQUESTS || !receiveLine(clientSocket, pending, request)) {
+            handshake = HandshakeResult::Rejected;
+            break;
+        }
+        handshake = handleClientHandshake(clientSocket, request);
+        // Keep-alives do not use up the handshake's requests
+        if (!isKeepAlive(request)) {
+            ++requests;
+        }
+    }
+    if (handshake != HandshakeResult::Authenticated) {
+        closeConnection(clientSocket);
+        return;
+    }
+    completeHandshake(clientSocket);
+
+    // Main client handling loop
+    std::string message;
+    while (receiveLine(clientSocket, pending, message) && processClientCommand(clientSocket, message)) {
+    }
+
+    endClientSession(clientSocket);
+    closeConnection(clientSocket);
+    std::cout << "Client disconnected." << std::endl;
+}
+
+// Clears every room, user and index so independent inputs start from the same
+// state. Only used between fuzzing runs, which have no live connections.
+void resetServerState() {
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        clients.clear();
+        userCredentials.clear();
+        chatRooms.clear();
+        socketUsernames.clear();
+        usernameSockets.clear();
+        savedProfiles.clear();
+        restoredMemberships.clear();
+        readCursors.clear();
+        snapshotDirtyRooms.clear();
+        snapshotDirtyUsers.clear();
+        socketRooms.clear();
+        retainedHistoryBytes = 0;
+        historyEvictionOrder.clear();
+    }
+    {
+        std::lock_guard<std::mutex> lock(presenceMutex);
+        roomPresence.clear();
+        userPresence.clear();
+        userPresenceRooms.clear();
+        presenceStatusMessages.clear();
+        dirtyPresenceRooms.clear();
+        presenceFlushQueue.clear();
+    }
+    {
+        std::lock_guard<std::mutex> lock(timerMutex);
+        activeTimers.clear();
+        std::memset(timerSlots, 0, sizeof(timerSlots));
+    }
+    {
+        std::lock_guard<std::mutex> lock(roomIndexMutex);
+        roomIndex.clear();
+        for (int order = 0; order < ROOM_SORT_ORDER_COUNT; ++order) {
+            roomOrder[order].clear();
+            roomPageCache[order].clear();
+        }
+        roomTrigrams.clear();
+        roomFoldedNames.clear();
+        roomActivityClock = 0;
+    }
+    {
+        std::lock_guard<std::mutex> lock(roomSearchIndexesMutex);
+        roomSearchIndexes.clear();
+    }
+    {
+        std::lock_guard<std::mutex> lock(searchWorkMutex);
+        searchWorkQueue.clear();
+    }
+    for (auto& worker : fanoutWorkers) {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->tasks.clear();
+        worker->rooms.clear();
+    }
+}
+
+struct ReplayStats {
+    size_t sessions;
+    size_t commands;
+    size_t bytesSent;
+    uint32_t outputDigest;
+};
+
+// Feeds a traffic capture through the handshake and command handlers in order,
+// with one fake socket per session. Malformed capture lines are skipped.
+void replayTraffic(std::istream& capture, ReplayStats& stats) {
+    stats.outputDigest = 2166136261u; // FNV-1a over everything sent to clients
+    clientOutputSink = [&stats](SOCKET, const char* data, int length) {
+        stats.bytesSent += static_cast<size_t>(length);
+        for (int i = 0; i < length; ++i) {
+            stats.outputDigest = (stats.outputDigest ^ static_cast<unsigned char>(data[i])) * 16777619u;
+        }
+    };
+
+    struct ReplaySession {
+        SOCKET socket;
+        int handshakeRequests;              // Negative once the session has logged in
+    };
+    std::unordered_map<uint32_t, ReplaySession> sessions;
+    std::string line;
+    while (std::getline(capture, line)) {
+        size_t separatorPos = line.find(' ');
+        uint32_t sessionId;
+        if (!parseSequenceNumber(line.substr(0, separatorPos), sessionId)) {
+            continue;
+        }
+        auto session = sessions.find(sessionId);
+        if (separatorPos == std::string::npos) {
+            if (session != sessions.end()) {
+                endClientSession(session->second.socket);
+                sessions.erase(session);
+            }
+            continue;
+        }
+
+        std::string command = line.substr(separatorPos + 1);
+        if (!command.empty() && command.back() == '\r') {
+            command.pop_back();
+        }
+        ++stats.commands;
+        if (session == sessions.end()) {
+            ReplaySession newSession = { static_cast<SOCKET>(++stats.sessions), 0 };
+            session = sessions.insert(std::make_pair(sessionId, newSession)).first;
+        }
+        ReplaySession& replaySession = session->second;
+        bool keepOpen;
+        if (replaySession.handshakeRequests < 0) {
+            keepOpen = handleClientMessage(replaySession.socket, command);
+        }
+        else {
+            // Mirrors clientHandler: the handshake ends with a login or a refusal
+            HandshakeResult handshake = handleClientHandshake(replaySession.socket, command);
+            if (!isKeepAlive(command)) {
+                ++replaySession.handshakeRequests;
+            }
+            if (handshake == HandshakeResult::Authenticated) {
+                replaySession.handshakeRequests = -1;
+            }
+            keepOpen = handshake == HandshakeResult::Authenticated ||
+                (handshake == HandshakeResult::Pending && replaySession.handshakeRequests < MAX_HANDSHAKE_REQUESTS);
+        }
+        if (!keepOpen) {
+            endClientSession(replaySession.socket);
+            sessions.erase(session);
+        }
+    }
+    for (const auto& session : sessions) {
+        endClientSession(session.second.socket);
+    }
+    clientOutputSink = nullptr;
+}
+
+// Replays a capture at full speed and reports throughput. The capture is read
+// into memory first so only the handlers are timed; the output digest tells
+// whether a change altered what clients would have received.
+int runTrafficReplay(const std::string& fileName) {
+    std::ifstream file(fileName, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open traffic capture." << std::endl;
+        return -1;
     }
-    return false;
+    std::istringstream capture(std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>()));
+    file.close();
+
+    replayMode = true;
+    loadUserCredentials();
+    startFanoutWorkers(FANOUT_WORKER_COUNT, false);
+    ReplayStats stats = {};
+    auto start = std::chrono::steady_clock::now();
+    replayTraffic(capture, stats);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    char digest[9];
+    std::snprintf(digest, sizeof(digest), "%08x", stats.outputDigest);
+    std::cout << "Replayed " << stats.commands << " commands from " << stats.sessions << " sessions in "
+              << seconds * 1000.0 << " ms (" << (seconds > 0 ? stats.commands / seconds : 0.0) << " commands/s), "
+              << stats.bytesSent << " bytes sent, output digest " << digest << std::endl;
+    return 0;
 }
 
-void sendPrivateMessage(const std::string& recipientUsername, const std::string& message, SOCKET senderSocket) {
-    std::string senderUsername;
-    for (const auto& client : clients) {
-        if (client.socket == senderSocket) {
-            senderUsername = client.username;
-            break;
+// Benchmarks drive the command handlers the way replay does, with fake sockets
+// and rate limits off, but with the background threads running so timers,
+// presence flushes and fan-out behave as on a live server. Output is not sent
+// anywhere; the sink only counts room messages, presence updates and refused
+// commands, and copies each write once as a stand-in for the cost of send.
+struct BenchCounters {
+    std::atomic<uint64_t> roomMessages;
+    std::atomic<uint64_t> presenceUpdates;
+    std::atomic<uint64_t> refusals;     // Overload replies and per-user message limit notices
+    std::atomic<uint64_t> busyRefusals; // Commands shed while MAX_COMMANDS_IN_FLIGHT were executing
+    // Indexed by session socket, 1 to MAX_BENCH_SESSIONS
+    std::atomic<uint64_t> sessionRefusals[MAX_BENCH_SESSIONS + 1];
+    std::atomic<uint64_t> echoes[MAX_BENCH_SESSIONS + 1]; // Messages "echo <socket>" delivered back to their sender
+};
+
+BenchCounters benchCounters;
+
+void countBenchOutput(SOCKET clientSocket, const char* data, int length) {
+    thread_local std::string sent;
+    sent.assign(data, static_cast<size_t>(length));
+    if (sent.compare(0, 7, "[bench-") == 0) {
+        ++benchCounters.roomMessages;
+        size_t echo = sent.rfind(" echo ");
+        if (echo != std::string::npos && clientSocket <= MAX_BENCH_SESSIONS && static_cast<SOCKET>(std::strtoull(sent.c_str() + echo + 6, nullptr, 10)) == clientSocket) {
+            ++benchCounters.echoes[clientSocket];
         }
     }
-    for (const auto& client : clients) {
-        if (client.username == recipientUsername) {
-            std::string privateMsg = "[Private] " + senderUsername + ": " + message + "\n";
-            send(client.socket, privateMsg.c_str(), static_cast<int>(privateMsg.length()), 0);
-            return;
+    else if (sent.compare(0, 9, "[Presence") == 0) {
+        ++benchCounters.presenceUpdates;
+    }
+    else if (sent.compare(0, 10, "[Overload]") == 0 || sent.compare(0, 50, "[Moderation] You are sending messages too quickly.") == 0) {
+        ++benchCounters.refusals;
+        if (sent.compare(0, 47, "[Overload] The server is busy, try again later.") == 0) {
+            ++benchCounters.busyRefusals;
+        }
+        if (clientSocket <= MAX_BENCH_SESSIONS) {
+            ++benchCounters.sessionRefusals[clientSocket];
         }
     }
 }
 
-void kickUserFromChatRoom(const std::string& roomName, SOCKET clientSocket) {
-    if (chatRooms.count(roomName) != 0) {
-        auto& members = chatRooms[roomName].members;
-        members.erase(clientSocket);
-        std::string kickMsg = "You have been kicked from the chat room: " + roomName + "\n";
-        send(clientSocket, kickMsg.c_str(), static_cast<int>(kickMsg.length()), 0);
-    }
+void startBenchmarkServer() {
+    replayMode = true;
+    clientOutputSink = countBenchOutput;
+    startFanoutWorkers(FANOUT_WORKER_COUNT, true);
+    std::thread presenceThread(presenceFlusher);
+    presenceThread.detach();
+    std::thread searchThread(searchIndexWorker);
+    searchThread.detach();
+    std::thread timerThread(timerWheelRunner);
+    timerThread.detach();
 }
 
-void banUserFromChatRoom(const std::string& roomName, SOCKET clientSocket) {
-    if (chatRooms.count(roomName) != 0) {
-        auto& members = chatRooms[roomName].members;
-        members.erase(clientSocket);
-        std::string banMsg = "You have been banned from the chat room: " + roomName + "\n";
-        send(clientSocket, banMsg.c_str(), static_cast<int>(banMsg.length()), 0);
-    }
+// Registers and logs in a fake session. Sockets are just numbers here.
+void benchLogin(SOCKET clientSocket, const std::string& username) {
+    handleClientHandshake(clientSocket, "REGISTER:" + username + ":bench");
+    handleClientHandshake(clientSocket, "AUTHENTICATE:" + username + ":bench");
 }
 
-void grantModeratorRights(const std::string& roomName, SOCKET clientSocket) {
-    if (chatRooms.count(roomName) != 0) {
-        auto& members = chatRooms[roomName].members;
-        for (auto& client : clients) {
-            if (client.socket == clientSocket && members.count(clientSocket) != 0) {
-                client.statusMessage = "[Moderator]";
-                std::string grantModMsg = "You have been granted moderator rights in the chat room: " + roomName + "\n";
-                send(client.socket, grantModMsg.c_str(), static_cast<int>(grantModMsg.length()), 0);
-                return;
-            }
-        }
+// Sends one room message and waits until 'recipients' members have received
+// it. Returns the time taken in microseconds.
+double timeRoomMessage(SOCKET senderSocket, const std::string& roomName, uint64_t recipients) {
+    uint64_t target = benchCounters.roomMessages + recipients;
+    auto start = std::chrono::steady_clock::now();
+    handleClientMessage(senderSocket, "SEND_ROOM:" + roomName + ":benchmark message");
+    while (benchCounters.roomMessages < target) {
+        std::this_thread::yield();
     }
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
 }
 
-void revokeModeratorRights(const std::string& roomName, SOCKET clientSocket) {
-    if (chatRooms.count(roomName) != 0) {
-        auto& members = chatRooms[roomName].members;
-        for (auto& client : clients) {
-            if (client.socket == clientSocket && members.count(clientSocket) != 0) {
-                client.statusMessage = "";
-                std::string revokeModMsg = "Your moderator rights have been revoked in the chat room: " + roomName + "\n";
-                send(client.socket, revokeModMsg.c_str(), static_cast<int>(revokeModMsg.length()), 0);
-                return;
-            }
-        }
+double percentile(std::vector<double> samples, double fraction) {
+    if (samples.empty()) {
+        return 0.0;
     }
+    std::sort(samples.begin(), samples.end());
+    return samples[std::min(samples.size() - 1, static_cast<size_t>(fraction * samples.size()))];
 }
 
-void sendUserProfile(const std::string& username, SOCKET clientSocket) {
-    for (const auto& client : clients) {
-        if (client.username == username) {
-            std::string profile = "[Profile]\n";
-            profile += "Username: " + client.username + "\n";
-            profile += "Profile Picture: " + client.profilePicture + "\n";
-            profile += "Status Message: " + client.statusMessage + "\n";
-            send(clientSocket, profile.c_str(), static_cast<int>(profile.length()), 0);
-            return;
-        }
+// Message latency in a 5000-member room while other members keep changing
+// their presence and typing state at increasing rates. Coalescing should keep
+// the presence broadcasts near one per flush interval whatever the churn.
+int runPresenceBenchmark() {
+    const size_t memberCount = 5000;
+    const int probes = 200;
+    const std::string roomName = "bench-presence";
+    startBenchmarkServer();
+    for (size_t i = 1; i <= memberCount; ++i) {
+        benchLogin(static_cast<SOCKET>(i), "member" + std::to_string(i));
+        handleClientMessage(static_cast<SOCKET>(i), "JOIN:" + roomName);
     }
-}
+    std::this_thread::sleep_for(std::chrono::milliseconds(PRESENCE_FLUSH_INTERVAL_MS * 2));
 
-void updateUserProfile(const std::string& username, const std::string& profilePicture, const std::string& statusMessage) {
-    for (auto& client : clients) {
-        if (client.username == username) {
-            client.profilePicture = profilePicture;
-            client.statusMessage = statusMessage;
-            break;
+    std::cout << "Presence churn in a " << memberCount << "-member room, " << probes << " messages per step" << std::endl;
+    const int churnRates[] = { 0, 1000, 10000, 100000 };
+    for (int churnRate : churnRates) {
+        std::atomic<bool> stop(false);
+        std::atomic<uint64_t> changes(0);
+        std::thread churn([&] {
+            static const char* const commands[] = { "TYPING:bench-presence", "PRESENCE:away", "PRESENCE:online" };
+            auto next = std::chrono::steady_clock::now();
+            for (size_t i = 0; churnRate > 0 && !stop; ++i) {
+                handleClientMessage(static_cast<SOCKET>(2 + i % (memberCount - 1)), commands[i % 3]);
+                ++changes;
+                next += std::chrono::microseconds(1000000 / churnRate);
+                std::this_thread::sleep_until(next);
+            }
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(PRESENCE_FLUSH_INTERVAL_MS));
+        uint64_t presenceBefore = benchCounters.presenceUpdates;
+        auto start = std::chrono::steady_clock::now();
+        std::vector<double> latencies;
+        for (int i = 0; i < probes; ++i) {
+            latencies.push_back(timeRoomMessage(1, roomName, memberCount));
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
         }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        stop = true;
+        churn.join();
+        double broadcasts = (benchCounters.presenceUpdates - presenceBefore) / static_cast<double>(memberCount) / seconds;
+        std::cout << "  churn " << churnRate << "/s (" << changes << " changes): message to last member p50 "
+                  << percentile(latencies, 0.5) << " us, p99 " << percentile(latencies, 0.99) << " us, "
+                  << broadcasts << " presence broadcasts/s" << std::endl;
     }
+    return 0;
 }
 
-void sendUnreadMessageNotification(SOCKET clientSocket) {
-    std::string notification = "[Notification] You have unread messages in the chat rooms:\n";
-    bool hasUnreadMessages = false;
-    for (const auto& chatRoom : chatRooms) {
-        if (chatRoom.second.members.count(clientSocket) != 0) {
-            const auto& messageHistory = chatRoom.second.messageHistory;
-            if (!messageHistory.empty()) {
-                std::string lastMessage = messageHistory.back();
-                if (lastMessage.substr(0, 3) != "[Notification]") {
-                    hasUnreadMessages = true;
-                    notification += "  - " + chatRoom.second.name + "\n";
+// Cost of the content filter per message for filters of growing size. The
+// messages are random words, so almost none match and each one is scanned to
+// the end, which is the slowest case.
+int runFilterBenchmark() {
+    const size_t wordCounts[] = { 10, 100, 1000, 10000 };
+    const size_t messageLengths[] = { 80, 1000 };
+    const int messageCount = 10000;
+    const int rounds = 20;
+    uint32_t seed = 42;
+    auto randomWord = [&seed]() {
+        std::string word;
+        seed = seed * 1664525u + 1013904223u;
+        size_t length = 4 + (seed >> 16) % 7;
+        for (size_t i = 0; i < length; ++i) {
+            seed = seed * 1664525u + 1013904223u;
+            word += static_cast<char>('a' + (seed >> 16) % 26);
+        }
+        return word;
+    };
+
+    std::cout << "Content filter cost per message, " << messageCount * rounds << " messages per step" << std::endl;
+    for (size_t wordCount : wordCounts) {
+        std::set<std::string> words;
+        while (words.size() < wordCount) {
+            words.insert(randomWord());
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::shared_ptr<const ContentFilter> filter = compileContentFilter(words);
+        double compileMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "  " << wordCount << " words (" << filter->transitions.size() << " states, compiled in " << compileMs << " ms):";
+        for (size_t messageLength : messageLengths) {
+            std::vector<std::string> messages(messageCount);
+            for (std::string& message : messages) {
+                while (message.size() < messageLength) {
+                    message += randomWord() + " ";
                 }
+                message.resize(messageLength);
             }
+            size_t matches = 0;
+            start = std::chrono::steady_clock::now();
+            for (int round = 0; round < rounds; ++round) {
+                for (const std::string& message : messages) {
+                    matches += contentFilterMatches(*filter, message) ? 1 : 0;
+                }
+            }
+            double nanoseconds = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            std::cout << (messageLength == messageLengths[0] ? " " : ", ") << messageLength << "-char message " << nanoseconds / (messageCount * rounds) << " ns ("
+                      << matches / rounds << " matched)";
         }
+        std::cout << std::endl;
     }
-    if (hasUnreadMessages) {
-        sendNotificationToClient(notification, clientSocket);
-    }
+    return 0;
 }
 
-void sendUnreadMessages(SOCKET clientSocket) {
-    for (const auto& chatRoom : chatRooms) {
-        if (chatRoom.second.members.count(clientSocket) != 0) {
-            const auto& messageHistory = chatRoom.second.messageHistory;
-            if (!messageHistory.empty()) {
-                std::string unreadMessages;
-                bool hasUnreadMessages = false;
-                for (const std::string& message : messageHistory) {
-                    if (message.substr(0, 3) != "[Notification]") {
-                        unreadMessages += message + "\n";
-                        hasUnreadMessages = true;
+bool startClusterNode(int clusterPort);
+
+// One node of the cluster benchmark, started by runClusterBenchmark with the
+// usual cluster options. Every session keeps a few messages in flight and sends
+// the next one when its own copy comes back through the room's owner, so load
+// follows what the cluster can deliver instead of piling up in the links.
+int runClusterNodeBenchmark(int clusterPort) {
+    const SOCKET sessions = 64;
+    const int rooms = 16;
+    const uint64_t window = 4;
+    const int senderThreads = 2;
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0 || !clusterEnabled) {
+        return -1;
+    }
+    startBenchmarkServer();
+    if (!startClusterNode(clusterPort)) {
+        std::cerr << "Failed to open cluster port." << std::endl;
+        return -1;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    for (SOCKET session = 1; session <= sessions; ++session) {
+        benchLogin(session, localNodeId + "-" + std::to_string(session));
+        handleClientMessage(session, "JOIN:bench-cluster" + std::to_string(session % rooms));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+
+    std::vector<uint64_t> sent(sessions + 1, 0);
+    std::atomic<bool> stop(false);
+    uint64_t deliveriesBefore = benchCounters.roomMessages;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> senders;
+    for (int t = 0; t < senderThreads; ++t) {
+        senders.push_back(std::thread([&, t] {
+            while (!stop) {
+                bool idle = true;
+                for (SOCKET session = 1 + t; session <= sessions; session += senderThreads) {
+                    if (sent[session] - benchCounters.echoes[session] < window) {
+                        handleClientMessage(session, "SEND_ROOM:bench-cluster" + std::to_string(session % rooms) + ":echo " + std::to_string(session));
+                        ++sent[session];
+                        idle = false;
                     }
                 }
-                if (hasUnreadMessages) {
-                    send(clientSocket, unreadMessages.c_str(), static_cast<int>(unreadMessages.length()), 0);
+                if (idle) {
+                    std::this_thread::yield();
                 }
             }
-        }
+        }));
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(3));
+    stop = true;
+    uint64_t totalSent = 0;
+    for (std::thread& sender : senders) {
+        sender.join();
+    }
+    for (SOCKET session = 1; session <= sessions; ++session) {
+        totalSent += sent[session];
     }
-}
 
-bool createUser(const std::string& username, const std::string& password) {
-    std::lock_guard<std::mutex> lock(clientsMutex);
-    if (userCredentials.count(username) == 0) {
-        userCredentials[username] = password;
-        std::ofstream userDB(USER_DATABASE_FILE, std::ios::app);
-        if (userDB.is_open()) {
-            userDB << username << ":" << password << "\n";
-            userDB.close();
-            return true;
+    // Let the messages still in flight arrive, then stay up while the other nodes finish
+    uint64_t delivered = 0;
+    auto last = start;
+    for (int quiet = 0; quiet < 3;) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        uint64_t now = benchCounters.roomMessages - deliveriesBefore;
+        quiet = now == delivered ? quiet + 1 : 0;
+        if (now != delivered) {
+            delivered = now;
+            last = std::chrono::steady_clock::now();
         }
     }
-    return false;
+    double seconds = std::chrono::duration<double>(last - start).count();
+    std::cout << "Node " << localNodeId << " sent " << totalSent << " delivered " << delivered << " seconds " << seconds << std::endl;
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    return 0;
 }
 
-bool loadUserCredentials() {
-    std::ifstream userDB(USER_DATABASE_FILE);
-    if (userDB.is_open()) {
-        std::string line;
-        while (std::getline(userDB, line)) {
-            size_t separatorPos = line.find(':');
-            if (separatorPos != std::string::npos) {
-                std::string username = line.substr(0, separatorPos);
-                std::string password = line.substr(separatorPos + 1);
-                userCredentials[username] = password;
+// Starts clusters of one to four nodes as separate processes on loopback and
+// adds up their throughput. Each node has the same number of sessions spread
+// over rooms that every node shares, so a message goes through the room's owner
+// and out to every node.
+int runClusterBenchmark(const std::string& program, int basePort) {
+    const int maxNodes = 4;
+    std::cout << "Cluster throughput with 64 sessions per node in 16 rooms shared by all nodes, 3 s of load per step" << std::endl;
+    for (int nodeCount = 1; nodeCount <= maxNodes; ++nodeCount) {
+        // Fresh ports for every step, so links closed by the previous step do not get in the way
+        int firstPort = basePort + 10 * nodeCount;
+        std::vector<FILE*> nodes;
+        for (int node = 0; node < nodeCount; ++node) {
+            std::string command = "\"" + program + "\" --bench cluster-node --node bench" + std::to_string(node) +
+                " --cluster-port " + std::to_string(firstPort + node);
+            for (int peer = 0; peer < nodeCount; ++peer) {
+                if (peer != node) {
+                    command += " --peer bench" + std::to_string(peer) + "=127.0.0.1:" + std::to_string(firstPort + peer);
+                }
+            }
+            FILE* output = _popen(command.c_str(), "r");
+            if (output == nullptr) {
+                std::cerr << "Failed to start a cluster node." << std::endl;
+                return -1;
             }
+            nodes.push_back(output);
         }
-        userDB.close();
-        return true;
+        uint64_t totalSent = 0;
+        uint64_t totalDelivered = 0;
+        double seconds = 0.0;
+        int reported = 0;
+        for (FILE* output : nodes) {
+            char line[256];
+            while (std::fgets(line, sizeof(line), output) != nullptr) {
+                char nodeId[64];
+                unsigned long long sent, delivered;
+                double nodeSeconds;
+                if (std::sscanf(line, "Node %63s sent %llu delivered %llu seconds %lf", nodeId, &sent, &delivered, &nodeSeconds) == 4) {
+                    totalSent += sent;
+                    totalDelivered += delivered;
+                    seconds = std::max(seconds, nodeSeconds);
+                    ++reported;
+                }
+            }
+            _pclose(output);
+        }
+        if (reported != nodeCount || seconds <= 0.0) {
+            std::cout << "  " << nodeCount << " nodes: only " << reported << " nodes reported" << std::endl;
+            continue;
+        }
+        std::cout << "  " << nodeCount << " nodes: " << totalSent / seconds << " messages/s, "
+                  << totalDelivered / seconds << " deliveries/s" << std::endl;
     }
-    return false;
+    return 0;
 }
 
-bool saveFile(const std::string& fileName, const std::string& data) {
-    std::ofstream file(FILE_STORAGE_DIRECTORY + fileName, std::ios::binary);
-    if (file.is_open()) {
-        file << data;
-        file.close();
-        return true;
+// Goodput of closed-loop clients sending room messages through admission
+// control, from well below to well past the point where the server saturates.
+// Rate limits are on, as on a live server, so a command can be refused by the
+// per-user command and message buckets, by the per-room message bucket or by
+// load shedding once MAX_COMMANDS_IN_FLIGHT are executing; the shed share is
+// reported separately. Past saturation the extra load should be refused while
+// the messages served per second stay flat. A client that is refused backs off
+// before retrying, as clients are expected to, doubling the wait from 1 ms up
+// to 64 ms while it keeps being refused.
+int runGoodputBenchmark() {
+    const int clientCounts[] = { 1, 4, 16, 64, 256 };
+    const int rooms = 16;
+    const SOCKET listenersPerRoom = 32;
+    const int stepSeconds = 2;
+    startBenchmarkServer();
+    for (SOCKET client = 1; client <= MAX_BENCH_SESSIONS; ++client) {
+        benchLogin(client, "client" + std::to_string(client));
+        handleClientMessage(client, "JOIN:bench-goodput" + std::to_string(client % rooms));
     }
-    return false;
-}
-
-std::string readFile(const std::string& fileName) {
-    std::ifstream file(FILE_STORAGE_DIRECTORY + fileName, std::ios::binary);
-    if (file.is_open()) {
-        std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-        file.close();
-        return content;
+    for (SOCKET listener = 0; listener < listenersPerRoom * rooms; ++listener) {
+        SOCKET listenerSocket = MAX_BENCH_SESSIONS + 1 + listener;
+        benchLogin(listenerSocket, "listener" + std::to_string(listener));
+        handleClientMessage(listenerSocket, "JOIN:bench-goodput" + std::to_string(listener % rooms));
     }
-    return "";
-}
-
-void clientHandler(SOCKET clientSocket) {
-    char buffer[BUFFER_SIZE];
+    benchRateLimits = true;
 
-    // Receive data from the client
-    memset(buffer, 0, BUFFER_SIZE);
-    int bytesRead = recv(clientSocket, buffer, BUFFER_SIZE, 0);
-    if (bytesRead == SOCKET_ERROR) {
-        std::cerr << "Error receiving data from client." << std::endl;
-        closesocket(clientSocket);
-        return;
+    std::cout << "Goodput of closed-loop clients in " << rooms << " rooms with " << listenersPerRoom << " listeners each, "
+              << stepSeconds << " s per step" << std::endl;
+    for (int clientCount : clientCounts) {
+        std::atomic<bool> stop(false);
+        std::atomic<uint64_t> commands(0);
+        std::vector<std::vector<double>> latencies(clientCount);
+        uint64_t refusalsBefore = benchCounters.refusals;
+        uint64_t busyRefusalsBefore = benchCounters.busyRefusals;
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> clients;
+        for (int c = 0; c < clientCount; ++c) {
+            clients.push_back(std::thread([&, c] {
+                SOCKET client = static_cast<SOCKET>(1 + c);
+                std::string command = "SEND_ROOM:bench-goodput" + std::to_string(client % rooms) + ":goodput";
+                int backoffMs = 1;
+                while (!stop) {
+                    uint64_t refusals = benchCounters.sessionRefusals[client];
+                    auto sent = std::chrono::steady_clock::now();
+                    processClientCommand(client, command);
+                    latencies[c].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - sent).count());
+                    ++commands;
+                    if (benchCounters.sessionRefusals[client] == refusals) {
+                        backoffMs = 1;
+                    }
+                    else {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(backoffMs));
+                        backoffMs = std::min(backoffMs * 2, 64);
+                    }
+                }
+            }));
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(stepSeconds));
+        stop = true;
+        for (std::thread& client : clients) {
+            client.join();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        uint64_t refused = benchCounters.refusals - refusalsBefore;
+        uint64_t shed = benchCounters.busyRefusals - busyRefusalsBefore;
+        std::vector<double> all;
+        for (const std::vector<double>& clientLatencies : latencies) {
+            all.insert(all.end(), clientLatencies.begin(), clientLatencies.end());
+        }
+        std::cout << "  " << clientCount << " clients: " << commands / seconds << " commands/s offered, "
+                  << (commands - refused) / seconds << " messages/s served, " << 100.0 * (refused - shed) / std::max<uint64_t>(commands, 1)
+                  << "% rate limited, " << 100.0 * shed / std::max<uint64_t>(commands, 1)
+                  << "% shed, p99 latency " << percentile(all, 0.99) << " us" << std::endl;
     }
+    benchRateLimits = false;
+    return 0;
+}
 
-    std::string request(buffer);
-
-    // Process the client's request
-    if (request.substr(0, 13) == "AUTHENTICATE:") {
-        std::string credentials = request.substr(13);
-        size_t separatorPos = credentials.find(':');
-        if (separatorPos != std::string::npos) {
-            std::string username = credentials.substr(0, separatorPos);
-            std::string password = credentials.substr(separatorPos + 1);
-            bool authenticated = authenticateUser(username, password);
-            sendAuthenticationResponse(authenticated, clientSocket);
-
-            if (authenticated) {
-                std::unique_lock<std::mutex> lock(clientsMutex);
-                clients.push_back(Client{ clientSocket, username, "", "", false });
-                lock.unlock();
-                clientCV.notify_all();
-                sendUnreadMessageNotification(clientSocket);
-                sendUnreadMessages(clientSocket);
+// Time for a message to reach the last member of rooms of growing size, with
+// the room delivered directly by the sending thread and with tiered fan-out.
+// Members are added straight to the room, without sessions or presence, so
+// only the sender is a logged-in client.
+int runFanoutBenchmark() {
+    const size_t roomSizes[] = { 100, 1000, 5000, 10000, 20000, 50000 };
+    const int probes = 50;
+    startBenchmarkServer();
+    SOCKET nextSocket = MAX_BENCH_SESSIONS + 1;
+    std::cout << "Time to the last recipient, " << probes << " messages per room size, " << FANOUT_WORKER_COUNT << " fan-out workers" << std::endl;
+    for (size_t roomSize : roomSizes) {
+        std::cout << "  " << roomSize << " members:";
+        for (int tiered = 0; tiered < 2; ++tiered) {
+            std::string roomName = std::string("bench-fanout-") + (tiered ? "tiered-" : "direct-") + std::to_string(roomSize);
+            largeRoomThreshold = tiered ? 2 : SIZE_MAX;
+            SOCKET sender = nextSocket++;
+            benchLogin(sender, roomName + "-sender");
+            handleClientMessage(sender, "JOIN:" + roomName);
+            for (size_t member = 1; member < roomSize; ++member) {
+                SOCKET memberSocket = nextSocket++;
+                joinChatRoom(roomName, memberSocket, roomName + "-" + std::to_string(member));
+            }
+            std::vector<double> latencies;
+            for (int i = 0; i < probes; ++i) {
+                latencies.push_back(timeRoomMessage(sender, roomName, roomSize));
             }
+            std::cout << (tiered ? ", tiered" : " direct") << " p50 " << percentile(latencies, 0.5) << " us, p99 " << percentile(latencies, 0.99) << " us";
         }
+        std::cout << std::endl;
     }
-    else if (request.substr(0, 9) == "REGISTER:") {
-        std::string credentials = request.substr(9);
-        size_t separatorPos = credentials.find(':');
-        if (separatorPos != std::string::npos) {
-            std::string username = credentials.substr(0, separatorPos);
-            std::string password = credentials.substr(separatorPos + 1);
-            bool registered = createUser(username, password);
-            std::string response = registered ? "Registration successful!\n" : "Registration failed. Username already exists.\n";
-            send(clientSocket, response.c_str(), static_cast<int>(response.length()), 0);
-        }
+    largeRoomThreshold = DEFAULT_LARGE_ROOM_THRESHOLD;
+    return 0;
+}
+
+int runBenchmark(const std::string& name, const std::string& program, int clusterPort) {
+    if (name == "presence") {
+        return runPresenceBenchmark();
     }
-    else {
-        send(clientSocket, "Invalid request.\n", 17, 0);
+    if (name == "filter") {
+        return runFilterBenchmark();
     }
+    if (name == "fanout") {
+        return runFanoutBenchmark();
+    }
+    if (name == "goodput") {
+        return runGoodputBenchmark();
+    }
+    if (name == "cluster") {
+        return runClusterBenchmark(program, clusterPort > 0 ? clusterPort : DEFAULT_BENCH_CLUSTER_PORT);
+    }
+    if (name == "cluster-node") {
+        return runClusterNodeBenchmark(clusterPort);
+    }
+    std::cerr << "Unknown benchmark: " << name << std::endl;
+    return -1;
+}
 
-    // Main client handling loop
-    while (true) {
-        // Receive data from the client
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytesRead = recv(clientSocket, buffer, BUFFER_SIZE, 0);
-        if (bytesRead == SOCKET_ERROR) {
-            std::cerr << "Error receiving data from client." << std::endl;
-            closesocket(clientSocket);
-            break;
-        }
-
-        std::string message(buffer);
+#ifdef CHAT_SERVER_FUZZ
+// libFuzzer entry point, built with -DCHAT_SERVER_FUZZ -fsanitize=fuzzer,address
+// in place of main. Every input is replayed as a traffic capture from a clean state.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    replayMode = true;
+    if (fanoutWorkers.empty()) {
+        startFanoutWorkers(FANOUT_WORKER_COUNT, false);
+    }
+    resetServerState();
+    std::istringstream capture(std::string(reinterpret_cast<const char*>(data), size));
+    ReplayStats stats = {};
+    replayTraffic(capture, stats);
+    return 0;
+}
+#endif
 
-        // Process the client's message
-        if (message.substr(0, 5) == "JOIN:") {
-            std::string roomName = message.substr(5);
-            joinChatRoom(roomName, clientSocket);
-            std::string response = "Joined chat room: " + roomName + "\n";
-            send(clientSocket, response.c_str(), static_cast<int>(response.length()), 0);
+// Command line: [--port N] [--node ID --cluster-port N --peer ID=HOST:PORT ...
+//                [--cluster-host ADDR] [--cluster-key KEY]]
+//               [--record FILE] [--replay FILE] [--bench NAME] [--large-room-threshold N]
+// Every node of a cluster must be started with the same set of node IDs.
+bool parseCommandLine(int argc, char* argv[], int& port, int& clusterPort) {
+    for (int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            return false;
         }
-        else if (message.substr(0, 6) == "LEAVE:") {
-            std::string roomName = message.substr(6);
-            leaveChatRoom(roomName, clientSocket);
-            std::string response = "Left chat room: " + roomName + "\n";
-            send(clientSocket, response.c_str(), static_cast<int>(response.length()), 0);
+        std::string value = argv[++i];
+        if (option == "--port") {
+            port = std::atoi(value.c_str());
         }
-        else if (message.substr(0, 10) == "SEND_ROOM:") {
-            size_t separatorPos = message.find(':', 10);
-            if (separatorPos != std::string::npos) {
-                std::string roomName = message.substr(10, separatorPos - 10);
-                std::string roomMessage = message.substr(separatorPos + 1);
-                if (isClientInChatRoom(roomName, clientSocket)) {
-                    ChatRoom& chatRoom = chatRooms[roomName];
-                    std::string fullMessage = "[" + roomName + "] " + message.substr(separatorPos + 1);
-                    std::lock_guard<std::mutex> lock(clientsMutex);
-                    auto& members = chatRoom.members;
-                    if (members.count(clientSocket) != 0) {
-                        for (SOCKET member : members) {
-                            send(member, fullMessage.c_str(), static_cast<int>(fullMessage.length()), 0);
-                        }
-                        chatRoom.messageHistory.push_back(fullMessage);
-                    }
-                    for (auto& client : clients) {
-                        if (client.socket == clientSocket) {
-                            client.hasUnreadMessages = true;
-                            break;
-                        }
-                    }
-                }
-                else {
-                    std::string response = "You are not a member of the chat room: " + roomName + "\n";
-                    send(clientSocket, response.c_str(), static_cast<int>(response.length()), 0);
-                }
-            }
+        else if (option == "--node") {
+            localNodeId = value;
+            clusterEnabled = true;
         }
-        else if (message.substr(0, 14) == "SEND_PRIVATE:") {
-            size_t separatorPos = message.find(':', 14);
-            if (separatorPos != std::string::npos) {
-                std::string recipientUsername = message.substr(14, separatorPos - 14);
-                std::string privateMessage = message.substr(separatorPos + 1);
-                sendPrivateMessage(recipientUsername, privateMessage, clientSocket);
-            }
+        else if (option == "--record") {
+            trafficRecordFile = value;
         }
-        else if (message.substr(0, 5) == "LIST:") {
-            std::string roomList = getChatRoomList();
-            send(clientSocket, roomList.c_str(), static_cast<int>(roomList.length()), 0);
+        else if (option == "--replay") {
+            trafficReplayFile = value;
         }
-        else if (message.substr(0, 10) == "KICK_USER:") {
-            size_t separatorPos = message.find(':', 10);
-            if (separatorPos != std::string::npos) {
-                std::string roomName = message.substr(10, separatorPos - 10);
-                SOCKET targetSocket = std::stoi(message.substr(separatorPos + 1));
-                if (isUserModerator(roomName, clientSocket)) {
-                    kickUserFromChatRoom(roomName, targetSocket);
-                }
-                else {
-                    std::string response = "You do not have sufficient privileges to kick users from chat room: " + roomName + "\n";
-                    send(clientSocket, response.c_str(), static_cast<int>(response.length()), 0);
-                }
-            }
+        else if (option == "--bench") {
+            benchmarkName = value;
         }
-        else if (message.substr(0, 9) == "BAN_USER:") {
-            size_t separatorPos = message.find(':', 9);
-            if (separatorPos != std::string::npos) {
-                std::string roomName = message.substr(9, separatorPos - 9);
-                SOCKET targetSocket = std::stoi(message.substr(separatorPos + 1));
-                if (isUserModerator(roomName, clientSocket)) {
-                    banUserFromChatRoom(roomName, targetSocket);
-                }
-                else {
-                    std::string response = "You do not have sufficient privileges to ban users from chat room: " + roomName + "\n";
-                    send(clientSocket, response.c_str(), static_cast<int>(response.length()), 0);
-                }
+        else if (option == "--large-room-threshold") {
+            int threshold = std::atoi(value.c_str());
+            if (threshold < 2) {
+                return false;
             }
+            largeRoomThreshold = static_cast<size_t>(threshold);
         }
-        else if (message.substr(0, 15) == "GRANT_MODERATOR:") {
-            size_t separatorPos = message.find(':', 15);
-            if (separatorPos != std::string::npos) {
-                std::string roomName = message.substr(15, separatorPos - 15);
-                SOCKET targetSocket = std::stoi(message.substr(separatorPos + 1));
-                if (isUserModerator(roomName, clientSocket)) {
-                    grantModeratorRights(roomName, targetSocket);
-                }
-                else {
-                    std::string response = "You do not have sufficient privileges to grant moderator rights in chat room: " + roomName + "\n";
-                    send(clientSocket, response.c_str(), static_cast<int>(response.length()), 0);
-                }
-            }
+        else if (option == "--cluster-port") {
+            clusterPort = std::atoi(value.c_str());
         }
-        else if (message.substr(0, 16) == "REVOKE_MODERATOR:") {
-            size_t separatorPos = message.find(':', 16);
-            if (separatorPos != std::string::npos) {
-                std::string roomName = message.substr(16, separatorPos - 16);
-                SOCKET targetSocket = std::stoi(message.substr(separatorPos + 1));
-                if (isUserModerator(roomName, clientSocket)) {
-                    revokeModeratorRights(roomName, targetSocket);
-                }
-                else {
-                    std::string response = "You do not have sufficient privileges to revoke moderator rights in chat room: " + roomName + "\n";
-                    send(clientSocket, response.c_str(), static_cast<int>(response.length()), 0);
-                }
+        else if (option == "--peer") {
+            size_t idEnd = value.find('=');
+            size_t hostEnd = value.rfind(':');
+            if (idEnd == std::string::npos || hostEnd == std::string::npos || hostEnd < idEnd) {
+                return false;
             }
-        }
-        else if (message.substr(0, 13) == "SHOW_PROFILE:") {
-            std::string username = message.substr(13);
-            sendUserProfile(username, clientSocket);
-        }
-        else if (message.substr(0, 14) == "UPDATE_PROFILE:") {
-            size_t separatorPos = message.find(':', 14);
-            if (separatorPos != std::string::npos) {
-                std::string profilePicture = message.substr(14, separatorPos - 14);
-                std::string statusMessage = message.substr(separatorPos + 1);
-                std::string username;
-                for (auto& client : clients) {
-                    if (client.socket == clientSocket) {
-                        username = client.username;
-                        break;
-                    }
-                }
-                updateUserProfile(username, profilePicture, statusMessage);
-                std::string response = "Profile updated successfully!\n";
-                send(clientSocket, response.c_str(), static_cast<int>(response.length()), 0);
+            std::shared_ptr<ClusterPeer> peer = std::make_shared<ClusterPeer>();
+            peer->nodeId = value.substr(0, idEnd);
+            peer->host = value.substr(idEnd + 1, hostEnd - idEnd - 1);
+            peer->port = std::atoi(value.substr(hostEnd + 1).c_str());
+            peer->address = inet_addr(peer->host.c_str());
+            if (peer->nodeId.empty() || peer->address == INADDR_NONE) {
+                return false;
             }
+            clusterPeers[peer->nodeId] = peer;
         }
-        else if (message.substr(0, 4) == "SEND") {
-            size_t separatorPos = message.find(':', 4);
-            if (separatorPos != std::string::npos) {
-                std::string fileName = message.substr(4, separatorPos - 4);
-                std::string fileData = message.substr(separatorPos + 1);
-                bool saved = saveFile(fileName, fileData);
-                std::string response = saved ? "File saved successfully!\n" : "Failed to save file.\n";
-                send(clientSocket, response.c_str(), static_cast<int>(response.length()), 0);
+        else if (option == "--cluster-host") {
+            clusterBindAddress = inet_addr(value.c_str());
+            if (clusterBindAddress == INADDR_NONE) {
+                return false;
             }
         }
-        else if (message.substr(0, 3) == "GET") {
-            std::string fileName = message.substr(3);
-            std::string fileData = readFile(fileName);
-            std::string response = fileData.empty() ? "File not found.\n" : fileData;
-            send(clientSocket, response.c_str(), static_cast<int>(response.length()), 0);
-        }
-        else if (message.substr(0, 4) == "EXIT") {
-            closesocket(clientSocket);
-            break;
+        else if (option == "--cluster-key") {
+            clusterKey = value;
         }
         else {
-            send(clientSocket, "Invalid command.\n", 17, 0);
+            return false;
         }
     }
+    return !clusterEnabled || clusterPort > 0;
+}
 
-    // Remove client from the list of connected clients
-    std::unique_lock<std::mutex> lock(clientsMutex);
-    clients.erase(std::remove_if(clients.begin(), clients.end(), std::bind(clientSocketMatches, std::placeholders::_1, clientSocket)), clients.end());
-    lock.unlock();
-    std::cout << "Client disconnected." << std::endl;
+SOCKET createListeningSocket(unsigned long bindAddress, int port) {
+    SOCKET listeningSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listeningSocket == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = bindAddress;
+    address.sin_port = htons(static_cast<u_short>(port));
+    if (bind(listeningSocket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR ||
+        listen(listeningSocket, SOMAXCONN) == SOCKET_ERROR) {
+        closesocket(listeningSocket);
+        return INVALID_SOCKET;
+    }
+    return listeningSocket;
+}
+
+// Builds the hash ring and starts the links to every peer. Returns false if the
+// cluster port cannot be opened.
+bool startClusterNode(int clusterPort) {
+    SOCKET clusterSocket = createListeningSocket(clusterBindAddress, clusterPort);
+    if (clusterSocket == INVALID_SOCKET) {
+        return false;
+    }
+    addClusterNode(localNodeId);
+    for (const auto& peer : clusterPeers) {
+        addClusterNode(peer.first);
+        std::thread senderThread(clusterPeerSender, peer.second);
+        senderThread.detach();
+    }
+    std::thread clusterThread(clusterListener, clusterSocket);
+    clusterThread.detach();
+    return true;
 }
 
-int main() {
+#ifndef CHAT_SERVER_FUZZ
+int main(int argc, char* argv[]) {
+    int port = DEFAULT_SERVER_PORT;
+    int clusterPort = 0;
+    if (!parseCommandLine(argc, argv, port, clusterPort)) {
+        std::cerr << "Usage: server [--port N] [--node ID --cluster-port N --peer ID=HOST:PORT ... [--cluster-host ADDR] [--cluster-key KEY]] [--record FILE] [--replay FILE] [--bench NAME] [--large-room-threshold N]" << std::endl;
+        return -1;
+    }
+    if (!trafficReplayFile.empty()) {
+        return runTrafficReplay(trafficReplayFile);
+    }
+    if (!benchmarkName.empty()) {
+        // Benchmarks leave their background threads running, so exit the same way as below
+        int result = runBenchmark(benchmarkName, argv[0], clusterPort);
+        std::cout.flush();
+        std::_Exit(result == 0 ? 0 : 1);
+    }
+
     // Initialize Winsock
     WSADATA wsaData;
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
@@ -532,9 +5041,10 @@ int main() {
 
     // Bind the listening socket to a local address and port
     sockaddr_in serverAddress;
+    memset(&serverAddress, 0, sizeof(serverAddress));
     serverAddress.sin_family = AF_INET;
     serverAddress.sin_addr.s_addr = INADDR_ANY;
-    serverAddress.sin_port = htons(8888); // Port 8888
+    serverAddress.sin_port = htons(static_cast<u_short>(port));
     if (bind(listeningSocket, reinterpret_cast<sockaddr*>(&serverAddress), sizeof(serverAddress)) == SOCKET_ERROR) {
         std::cerr << "Failed to bind listening socket." << std::endl;
         closesocket(listeningSocket);
@@ -558,26 +5068,104 @@ int main() {
         return -1;
     }
 
-    while (true) {
+    // Deliver messages to large rooms from parallel fan-out workers
+    startFanoutWorkers(FANOUT_WORKER_COUNT, true);
+
+    // Join the cluster: build the hash ring and start the inter-node links
+    if (clusterEnabled) {
+        if (!startClusterNode(clusterPort)) {
+            std::cerr << "Failed to open cluster port." << std::endl;
+            closesocket(listeningSocket);
+            WSACleanup();
+            return -1;
+        }
+        snapshotFile = "server_state." + localNodeId + ".snap";
+        std::cout << "Cluster node " << localNodeId << " with " << clusterPeers.size() << " peers." << std::endl;
+    }
+
+    // Restore rooms and profiles from the last state snapshot, if any
+    loadServerSnapshot();
+
+    // Record received commands so the traffic can be replayed later
+    if (!trafficRecordFile.empty()) {
+        trafficRecord.open(trafficRecordFile, std::ios::binary | std::ios::app);
+        if (!trafficRecord.is_open()) {
+            std::cerr << "Failed to open traffic capture." << std::endl;
+            closesocket(listeningSocket);
+            WSACleanup();
+            return -1;
+        }
+    }
+
+    // Periodically snapshot server state so a restart can pick up where it left off
+    std::thread snapshotThread(snapshotWriter);
+    snapshotThread.detach();
+
+    // Broadcast coalesced presence updates in the background
+    std::thread presenceThread(presenceFlusher);
+    presenceThread.detach();
+
+    // Seal and merge search index segments in the background
+    std::thread searchThread(searchIndexWorker);
+    searchThread.detach();
+
+    // Drive connection heartbeats, idle timeouts and handshake deadlines
+    std::thread timerThread(timerWheelRunner);
+    timerThread.detach();
+    scheduleTimer(RATE_LIMIT_PRUNE_INTERVAL_MS, pruneRateLimitBuckets);
+
+    std::signal(SIGINT, requestShutdown);
+    std::signal(SIGTERM, requestShutdown);
+
+    while (!shutdownRequested) {
+        // Wait briefly for a connection so a shutdown request is noticed
+        fd_set readSet;
+        FD_ZERO(&readSet);
+        FD_SET(listeningSocket, &readSet);
+        timeval timeout = { 0, SHUTDOWN_POLL_MS * 1000 };
+        int ready = select(static_cast<int>(listeningSocket) + 1, &readSet, nullptr, nullptr, &timeout);
+        if (ready == 0 || (ready == SOCKET_ERROR && shutdownRequested)) {
+            continue;
+        }
+
         // Accept a new client connection
         sockaddr_in clientAddress;
         int clientAddressSize = sizeof(clientAddress);
-        SOCKET clientSocket = accept(listeningSocket, reinterpret_cast<sockaddr*>(&clientAddress), &clientAddressSize);
+        SOCKET clientSocket = ready == SOCKET_ERROR ? INVALID_SOCKET : accept(listeningSocket, reinterpret_cast<sockaddr*>(&clientAddress), &clientAddressSize);
         if (clientSocket == INVALID_SOCKET) {
             std::cerr << "Failed to accept client connection." << std::endl;
             closesocket(listeningSocket);
             WSACleanup();
             return -1;
         }
+        DWORD sendTimeout = CLIENT_SEND_TIMEOUT_MS;
+        setsockopt(clientSocket, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&sendTimeout), sizeof(sendTimeout));
+
+        // Refuse the connection up front if the server is overloaded
+        std::string address = inet_ntoa(clientAddress.sin_addr);
+        std::string overload;
+        if (!admitConnection(address, overload)) {
+            sendOverloadResponse(clientSocket, overload);
+            closesocket(clientSocket);
+            continue;
+        }
+        openConnection(clientSocket, address);
 
         // Create a new thread to handle the client
         std::thread clientThread(clientHandler, clientSocket);
         clientThread.detach();
     }
 
-    // Cleanup
-    closesocket(listeningSocket);
+    drainConnections(listeningSocket);
     WSACleanup();
+    {
+        std::lock_guard<std::mutex> lock(trafficRecordMutex);
+        trafficRecord.close();
+    }
+    std::cout << "Server stopped." << std::endl;
 
-    return 0;
+    // Background threads are detached and may still be waiting on globals, so
+    // exit without running static destructors underneath them
+    std::_Exit(0);
 }
+#endif